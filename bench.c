@@ -0,0 +1,425 @@
+/* Micro-benchmark of the queue operations, see bench.h */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "cqueue.h"
+#include "dudect/cpucycles.h"
+
+/* Our program needs to use regular malloc/free */
+#define INTERNAL 1
+#include "harness.h"
+
+#include "queue.h"
+#include "random.h"
+#include "report.h"
+
+extern void q_shuffle(struct list_head *);
+
+/* Below 2^HIST_SUB_BITS cycles every value gets its own bucket, above it
+ * every power of two is cut into 2^HIST_SUB_BITS buckets, so a latency is
+ * known within about 3%.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t count[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} hist_t;
+
+typedef enum {
+    OP_IH,
+    OP_IT,
+    OP_RH,
+    OP_RT,
+    OP_DM,
+    OP_SIZE,
+    OP_SWAP,
+    OP_REVERSE,
+    OP_SORT,
+    OP_SHUFFLE,
+    OP_DEDUP,
+    OP_DEDUP_UNSORTED,
+} op_t;
+
+static const struct {
+    const char *name;
+    op_t op;
+    bool whole;  /* operates on the whole queue */
+    bool filled; /* runs on a queue filled beforehand */
+} ops[] = {
+    {"ih", OP_IH, false, false},
+    {"it", OP_IT, false, false},
+    {"rh", OP_RH, false, true},
+    {"rt", OP_RT, false, true},
+    {"dm", OP_DM, false, true},
+    {"size", OP_SIZE, false, true},
+    {"swap", OP_SWAP, true, true},
+    {"reverse", OP_REVERSE, true, true},
+    {"sort", OP_SORT, true, true},
+    {"shuffle", OP_SHUFFLE, true, true},
+    {"dedup", OP_DEDUP, true, true},
+    {"dedup-u", OP_DEDUP_UNSORTED, true, true},
+};
+
+/* Queue under benchmark, either a list or a compact queue */
+typedef struct {
+    struct list_head *l;
+    cqueue_t *cq;
+} bench_queue_t;
+
+static size_t hist_index(uint64_t v)
+{
+    if (v < HIST_SUB)
+        return v;
+
+    int k = 63 - __builtin_clzll(v);
+    return (size_t) (k - HIST_SUB_BITS + 1) * HIST_SUB +
+           ((v >> (k - HIST_SUB_BITS)) - HIST_SUB);
+}
+
+/* Largest value falling into the bucket idx */
+static uint64_t hist_value(size_t idx)
+{
+    if (idx < HIST_SUB)
+        return idx;
+
+    int shift = idx / HIST_SUB - 1;
+    uint64_t low = (uint64_t) (HIST_SUB + idx % HIST_SUB) << shift;
+    return low + ((uint64_t) 1 << shift) - 1;
+}
+
+static void hist_record(hist_t *h, int64_t cycles)
+{
+    uint64_t v = cycles > cpucycles_overhead ? cycles - cpucycles_overhead : 0;
+
+    h->count[hist_index(v)]++;
+    h->total++;
+    if (v > h->max)
+        h->max = v;
+}
+
+/* Least latency that q of the runs did not exceed, 0 < q <= 1 */
+static uint64_t hist_percentile(const hist_t *h, double q)
+{
+    uint64_t rank = (uint64_t) (q * h->total + 0.5), seen = 0;
+
+    if (rank < 1)
+        rank = 1;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen >= rank)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char **make_strings(int n, int len)
+{
+    static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
+    char **strs = malloc(n * sizeof(char *));
+    char *buf = malloc((size_t) n * (len + 1));
+
+    if (!strs || !buf) {
+        free(strs);
+        free(buf);
+        return NULL;
+    }
+
+    for (int i = 0; i < n; i++) {
+        strs[i] = buf + (size_t) i * (len + 1);
+        prng_chars(strs[i], len, charset, sizeof(charset) - 1);
+        strs[i][len] = '\0';
+    }
+    return strs;
+}
+
+static void free_strings(char **strs)
+{
+    if (strs)
+        free(strs[0]);
+    free(strs);
+}
+
+static bool bq_new(bench_queue_t *q, bool compact)
+{
+    q->l = NULL;
+    q->cq = NULL;
+    if (compact)
+        q->cq = cq_new();
+    else
+        q->l = q_new();
+    return q->l || q->cq;
+}
+
+static void bq_free(bench_queue_t *q)
+{
+    q_free(q->l);
+    cq_free(q->cq);
+}
+
+/* Fill the queue with count of the nstrs strings, in order and repeated */
+static bool bq_fill(bench_queue_t *q, char **strs, int nstrs, int count)
+{
+    if (q->cq) {
+        for (int i = 0; i < count; i++) {
+            if (!cq_insert_tail(q->cq, strs[i % nstrs]))
+                return false;
+        }
+        return true;
+    }
+
+    for (; count > 0; count -= nstrs) {
+        if (!q_insert_tail_n(q->l, strs, count < nstrs ? count : nstrs))
+            return false;
+    }
+    return true;
+}
+
+/* Run the operation once, removed elements are put in *removed */
+static inline bool run_op(bench_queue_t *q,
+                          op_t op,
+                          char *s,
+                          element_t **removed)
+{
+    switch (op) {
+    case OP_IH:
+        return q->cq ? cq_insert_head(q->cq, s) : q_insert_head(q->l, s);
+    case OP_IT:
+        return q->cq ? cq_insert_tail(q->cq, s) : q_insert_tail(q->l, s);
+    case OP_RH:
+        if (q->cq)
+            return cq_remove_head(q->cq, NULL, 0);
+        return (*removed = q_remove_head(q->l, NULL, 0));
+    case OP_RT:
+        if (q->cq)
+            return cq_remove_tail(q->cq, NULL, 0);
+        return (*removed = q_remove_tail(q->l, NULL, 0));
+    case OP_DM:
+        return q->cq ? cq_delete_mid(q->cq) : q_delete_mid(q->l);
+    case OP_SIZE:
+        return q->cq ? cq_size(q->cq) : q_size(q->l);
+    case OP_SWAP:
+        if (q->cq)
+            cq_swap(q->cq);
+        else
+            q_swap(q->l);
+        return true;
+    case OP_REVERSE:
+        if (q->cq)
+            cq_reverse(q->cq);
+        else
+            q_reverse(q->l);
+        return true;
+    case OP_SORT:
+        if (q->cq)
+            cq_sort(q->cq);
+        else
+            q_sort(q->l);
+        return true;
+    case OP_SHUFFLE:
+        if (q->cq)
+            cq_shuffle(q->cq);
+        else
+            q_shuffle(q->l);
+        return true;
+    case OP_DEDUP:
+        return q->cq ? cq_delete_dup(q->cq) : q_delete_dup(q->l);
+    case OP_DEDUP_UNSORTED:
+        return q->cq ? cq_delete_dup_unsorted(q->cq)
+                     : q_delete_dup_unsorted(q->l);
+    }
+    return false;
+}
+
+/* Get the queue ready for the next round of an operation on the whole queue */
+static bool prepare_round(bench_queue_t *q,
+                          op_t op,
+                          char **strs,
+                          int nstrs,
+                          int n,
+                          bool scatter)
+{
+    bool compact = q->cq;
+
+    switch (op) {
+    case OP_SORT:
+        if (compact)
+            cq_shuffle(q->cq);
+        else
+            q_shuffle(q->l);
+        return true;
+    case OP_DEDUP:
+    case OP_DEDUP_UNSORTED:
+        /* dedup leaves only part of the queue, and runs on a sorted one */
+        bq_free(q);
+        if (!bq_new(q, compact) || !bq_fill(q, strs, nstrs, n))
+            return false;
+        if (op == OP_DEDUP_UNSORTED) {
+            if (scatter && !compact)
+                q_shuffle(q->l);
+            return true;
+        }
+        if (compact)
+            cq_sort(q->cq);
+        else
+            q_sort(q->l);
+        return true;
+    default:
+        return true;
+    }
+}
+
+static void report_results(const char *name,
+                           const bench_opts_t *opts,
+                           bool whole,
+                           int size,
+                           double seconds,
+                           const hist_t *h)
+{
+    /* runs per second, or elements handled per second for the operations
+     * on the whole queue
+     */
+    double done = whole ? (double) size * h->total : h->total;
+    double throughput = seconds > 0 ? done / seconds : 0;
+    uint64_t p50 = hist_percentile(h, 0.5), p90 = hist_percentile(h, 0.9);
+    uint64_t p99 = hist_percentile(h, 0.99), p999 = hist_percentile(h, 0.999);
+
+    if (opts->json) {
+        report(1,
+               "{\"op\": \"%s\", \"runs\": %d, \"size\": %d, \"len\": %d, "
+               "\"queue\": \"%s\", \"timer\": %d, \"seconds\": %.6f, "
+               "\"throughput\": %.0f, \"p50\": %" PRIu64 ", \"p90\": %" PRIu64
+               ", \"p99\": %" PRIu64 ", \"p99.9\": %" PRIu64
+               ", \"max\": %" PRIu64 "}",
+               name, (int) h->total, size, opts->len,
+               opts->compact ? "compact" : "list", cpucycles_timer, seconds,
+               throughput, p50, p90, p99, p999, h->max);
+        return;
+    }
+
+    report(1, "%s: %d runs on %d elements in %.3f s, %.2f M %s/s", name,
+           (int) h->total, size, seconds, throughput / 1e6,
+           whole ? "elements" : "runs");
+    report(1,
+           "cycles: p50 %" PRIu64 ", p90 %" PRIu64 ", p99 %" PRIu64
+           ", p99.9 %" PRIu64 ", max %" PRIu64,
+           p50, p90, p99, p999, h->max);
+}
+
+bool bench_run(const char *op, const bench_opts_t *opts)
+{
+    size_t which;
+    bench_queue_t q;
+    element_t **removed = NULL;
+    hist_t *h;
+    char **strs;
+    bool ok = true;
+    double seconds = 0;
+    int n = opts->n, size, nstrs;
+
+    for (which = 0; which < sizeof(ops) / sizeof(ops[0]); which++) {
+        if (!strcmp(ops[which].name, op))
+            break;
+    }
+    if (which == sizeof(ops) / sizeof(ops[0])) {
+        report(1, "Unknown operation '%s'", op);
+        return false;
+    }
+    if (n < 1 || opts->len < 0 || opts->rounds < 1) {
+        report(1, "Need positive numbers of runs and a string length");
+        return false;
+    }
+
+    /* the number of elements the runs start from */
+    if (ops[which].whole)
+        size = n;
+    else if (opts->size >= 0)
+        size = opts->size;
+    else
+        size = ops[which].filled ? n : 0;
+    nstrs = n > size ? n : size;
+
+    /* the benchmark measures the queue, not failures of the allocator */
+    int saved_probability = fail_probability;
+    fail_probability = 0;
+
+    h = calloc(1, sizeof(hist_t));
+    strs = make_strings(nstrs, opts->len);
+    if (!opts->compact && !ops[which].whole)
+        removed = calloc(n, sizeof(element_t *));
+    if (!h || !strs || (!opts->compact && !ops[which].whole && !removed) ||
+        !bq_new(&q, opts->compact)) {
+        report(1, "Could not allocate for the benchmark");
+        free(h);
+        free_strings(strs);
+        free(removed);
+        fail_probability = saved_probability;
+        return false;
+    }
+
+    if (!bq_fill(&q, strs, nstrs, size))
+        ok = false;
+    else if (opts->scatter && !opts->compact)
+        q_shuffle(q.l);
+
+    if (!ops[which].whole) {
+        op_t o = ops[which].op;
+        double start = now();
+        for (int i = 0; ok && i < n; i++) {
+            int64_t before = cpucycles();
+            run_op(&q, o, strs[i % nstrs], removed ? &removed[i] : NULL);
+            int64_t after = cpucycles();
+            hist_record(h, after - before);
+        }
+        seconds = now() - start;
+    } else {
+        for (int r = 0; ok && r < opts->rounds; r++) {
+            if (!prepare_round(&q, ops[which].op, strs, nstrs, n,
+                               opts->scatter)) {
+                ok = false;
+                break;
+            }
+            double start = now();
+            int64_t before = cpucycles();
+            run_op(&q, ops[which].op, NULL, NULL);
+            int64_t after = cpucycles();
+            seconds += now() - start;
+            hist_record(h, after - before);
+        }
+    }
+
+    if (removed) {
+        for (int i = 0; i < n; i++) {
+            if (removed[i])
+                q_release_element(removed[i]);
+        }
+    }
+    bq_free(&q);
+    fail_probability = saved_probability;
+
+    if (ok)
+        report_results(op, opts, ops[which].whole, size, seconds, h);
+    else
+        report(1, "Could not allocate for the benchmark");
+
+    free(h);
+    free_strings(strs);
+    free(removed);
+    return ok;
+}
@@ -0,0 +1,54 @@
+#ifndef LAB0_BENCH_H
+#define LAB0_BENCH_H
+
+#include <stdbool.h>
+
+/* Micro-benchmark of the queue operations.
+ *
+ * Every run of the operation is timed with cpucycles(), and the latencies
+ * are collected into a log-bucketed histogram, in the manner of
+ * HdrHistogram, to report their percentiles.
+ */
+
+/* Default number of runs of the operations on the whole queue */
+#define BENCH_ROUNDS 10
+
+/**
+ * bench_opts_t - What to benchmark
+ * @n: number of runs of the operation, or the size of the queue for the
+ *     operations on the whole queue (swap, reverse, sort, shuffle, dedup and
+ *     dedup-u)
+ * @size: number of elements queued before the runs of the other operations,
+ *        -1 for none before insertions and @n before the others
+ * @rounds: number of runs of the operations on the whole queue
+ * @len: length of the random strings the queue is filled with
+ * @compact: benchmark the compact queue of cqueue.h instead of the list
+ * @scatter: shuffle the list once filled, so that walking it jumps all over
+ *           memory instead of going from one node to the next allocated
+ * @json: report the results as a single JSON object
+ */
+typedef struct {
+    int n;
+    int size;
+    int rounds;
+    int len;
+    bool compact;
+    bool scatter;
+    bool json;
+} bench_opts_t;
+
+/**
+ * bench_run() - Benchmark a queue operation and report the results
+ * @op: operation, one of ih, it, rh, rt, dm, size, swap, reverse, sort,
+ *      shuffle, dedup, dedup-u
+ * @opts: what to benchmark
+ *
+ * The operations on the whole queue run on a queue shuffled or rebuilt in
+ * between as needed.
+ *
+ * Return: true for success, false for an unknown operation, bad arguments or
+ * allocation failed
+ */
+bool bench_run(const char *op, const bench_opts_t *opts);
+
+#endif /* LAB0_BENCH_H */
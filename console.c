@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -30,8 +31,16 @@ static bool block_timing = false;
 /* Time of day */
 static double first_time, last_time;
 
+/* Commands are also chained in a hash table of CMD_HASH_SIZE buckets, to
+ * find them without walking the list.  Must be a power of two.
+ */
+#define CMD_HASH_SIZE 64
+static cmd_ptr cmd_table[CMD_HASH_SIZE];
+
 /* Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
+ * Regular files are memory-mapped instead, and read without any copy but the
+ * one of each line into linebuf.
  */
 
 #define RIO_BUFSIZE 8192
@@ -42,12 +51,19 @@ struct RIO_ELE {
     int cnt;               /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *map;             /* Mapping of the whole file, NULL if not mapped */
+    size_t map_size;       /* Size of the mapping */
+    size_t map_pos;        /* Offset of the next unread byte in the mapping */
     rio_ptr prev;          /* Next element in stack */
 };
 
 static rio_ptr buf_stack;
 static char linebuf[RIO_BUFSIZE];
 
+/* Words of the command line being interpreted, pointing into the line */
+#define MAX_ARGS (RIO_BUFSIZE / 2)
+static char *argv_buf[MAX_ARGS];
+
 /* Maximum file descriptor */
 static int fd_max = 0;
 
@@ -67,6 +83,8 @@ static bool has_infile = false;
 static cmd_function quit_helpers[MAXQUIT];
 static int quit_helper_cnt = 0;
 
+static cmd_function post_cmd_helper = NULL;
+
 static void init_in();
 
 static bool push_file(char *fname);
@@ -74,6 +92,25 @@ static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+/* FNV-1a hash of a command name, folded into the table */
+static size_t cmd_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h & (CMD_HASH_SIZE - 1);
+}
+
+static cmd_ptr find_cmd(const char *name)
+{
+    cmd_ptr c = cmd_table[cmd_hash(name)];
+    while (c && strcmp(name, c->name) != 0)
+        c = c->hash_next;
+    return c;
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_function operation, char *documentation)
 {
@@ -90,6 +127,11 @@ void add_cmd(char *name, cmd_function operation, char *documentation)
     ele->documentation = documentation;
     ele->next = next_cmd;
     *last_loc = ele;
+
+    /* a command added again shadows the previous one */
+    size_t h = cmd_hash(name);
+    ele->hash_next = cmd_table[h];
+    cmd_table[h] = ele;
 }
 
 /* Add a new parameter */
@@ -114,51 +156,35 @@ void add_param(char *name,
     *last_loc = ele;
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
+/* Split a command line into its words in place, terminating each of them with
+ * a null character.  At most max words are stored into argv, the following
+ * ones are dropped.
+ *
+ * Return the number of words stored.
+ */
+static int parse_args(char *line, char *argv[], int max)
 {
-    /* Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
-
-    char *src = line;
-    char *dst = buf;
-    bool skipping = true;
-    int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
-        if (isspace(c)) {
-            if (!skipping) {
-                /* Hit end of word */
-                *dst++ = '\0';
-                skipping = true;
-            }
-        } else {
-            if (skipping) {
-                /* Hit start of new word */
-                argc++;
-                skipping = false;
-            }
-            *dst++ = c;
-        }
-    }
+    char *p = line;
+
+    while (true) {
+        while (isspace((unsigned char) *p))
+            p++;
+        if (*p == '\0')
+            break;
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
+        /* Hit start of new word */
+        if (argc < max)
+            argv[argc++] = p;
+        while (*p != '\0' && !isspace((unsigned char) *p))
+            p++;
+        if (*p == '\0')
+            break;
+        /* Hit end of word */
+        *p++ = '\0';
     }
 
-    free_block(buf, len + 1);
-    *argcp = argc;
-    return argv;
+    return argc;
 }
 
 static void record_error()
@@ -170,18 +196,12 @@ static void record_error()
     }
 }
 
-/* Execute a command that has already been split into arguments */
-static bool interpret_cmda(int argc, char *argv[])
+/* Execute a command found by find_cmd(), NULL if there was no such command */
+static bool run_cmd(cmd_ptr cmd, int argc, char *argv[])
 {
-    if (argc == 0)
-        return true;
-    /* Try to find matching command */
-    cmd_ptr next_cmd = cmd_list;
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
-    if (next_cmd) {
-        ok = next_cmd->operation(argc, argv);
+    if (cmd) {
+        ok = cmd->operation(argc, argv);
         if (!ok)
             record_error();
     } else {
@@ -190,23 +210,28 @@ static bool interpret_cmda(int argc, char *argv[])
         ok = false;
     }
 
+    if (post_cmd_helper && !quit_flag)
+        post_cmd_helper(argc, argv);
     return ok;
 }
 
-/* Execute a command from a command line */
+/* Execute a command that has already been split into arguments */
+static bool interpret_cmda(int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+    /* Try to find matching command */
+    return run_cmd(find_cmd(argv[0]), argc, argv);
+}
+
+/* Execute a command from a command line, which is split up in the process */
 static bool interpret_cmd(char *cmdline)
 {
     if (quit_flag)
         return false;
 
-    int argc;
-    char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
-
-    return ok;
+    int argc = parse_args(cmdline, argv_buf, MAX_ARGS);
+    return interpret_cmda(argc, argv_buf);
 }
 
 /* Set function to be executed as part of program exit */
@@ -218,6 +243,12 @@ void add_quit_helper(cmd_function qf)
         report_event(MSG_FATAL, "Exceeded limit on quit helpers");
 }
 
+/* Set function to be executed after every command */
+void set_post_cmd_helper(cmd_function pf)
+{
+    post_cmd_helper = pf;
+}
+
 /* Turn echoing on/off */
 void set_echo(bool on)
 {
@@ -234,6 +265,8 @@ static bool do_quit(int argc, char *argv[])
         c = c->next;
         free_block(ele, sizeof(cmd_ele));
     }
+    cmd_list = NULL;
+    memset(cmd_table, 0, sizeof(cmd_table));
 
     param_ptr p = param_list;
     while (p) {
@@ -393,10 +426,31 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+/* Run a command meant to fail, which is only an error if it does not */
+static bool do_fail(int argc, char *argv[])
+{
+    if (argc <= 1) {
+        report(1, "%s needs a command to run", argv[0]);
+        return false;
+    }
+
+    cmd_ptr cmd = find_cmd(argv[1]);
+    if (!cmd) {
+        report(1, "Unknown command '%s'", argv[1]);
+        return false;
+    }
+    if (cmd->operation(argc - 1, argv + 1)) {
+        report(1, "ERROR: %s was expected to fail", argv[1]);
+        return false;
+    }
+    return true;
+}
+
 /* Initialize interpreter */
 void init_cmd()
 {
     cmd_list = NULL;
+    memset(cmd_table, 0, sizeof(cmd_table));
     param_list = NULL;
     err_cnt = 0;
     quit_flag = false;
@@ -407,6 +461,7 @@ void init_cmd()
     ADD_COMMAND(source, " file           | Read commands from source file");
     ADD_COMMAND(log, " file           | Copy output to file");
     ADD_COMMAND(time, " cmd arg ...    | Time command execution");
+    ADD_COMMAND(fail, " cmd arg ...    | Run command expected to fail");
     add_cmd("#", do_comment_cmd, " ...            | Display comment");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
@@ -436,9 +491,23 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->cnt = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->map_size = 0;
+    rnew->map_pos = 0;
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
+    /* Map regular files, and read the others through the buffer */
+    struct stat st;
+    if (fname && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            rnew->map = map;
+            rnew->map_size = st.st_size;
+        }
+    }
+
     return true;
 }
 
@@ -448,6 +517,8 @@ static void pop_file()
     if (buf_stack) {
         rio_ptr rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_size);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -459,19 +530,38 @@ static void init_in()
     buf_stack = NULL;
 }
 
-/* Read command from input file.
- * When hit EOF, close that file and return NULL
+/* Copy the next line of the mapped file on top of the stack into linebuf, up
+ * to max bytes.  When hit EOF, close that file.
+ *
+ * Return the number of bytes copied, 0 at EOF.
  */
-static char *readline()
+static size_t read_mapped(size_t max)
 {
-    int cnt;
-    char c;
-    char *lptr = linebuf;
+    size_t left = buf_stack->map_size - buf_stack->map_pos;
+    char *start = buf_stack->map + buf_stack->map_pos;
 
-    if (!buf_stack)
-        return NULL;
+    if (left == 0) {
+        pop_file();
+        return 0;
+    }
+
+    char *nl = memchr(start, '\n', left < max ? left : max);
+    size_t len = nl ? (size_t) (nl - start) + 1 : (left < max ? left : max);
+    memcpy(linebuf, start, len);
+    buf_stack->map_pos += len;
+    return len;
+}
+
+/* Copy the next line of the file on top of the stack into linebuf through its
+ * buffer, up to max bytes.  When hit EOF, close that file.
+ *
+ * Return the number of bytes copied, 0 at EOF.
+ */
+static size_t read_buffered(size_t max)
+{
+    size_t cnt = 0;
 
-    for (cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
+    while (cnt < max) {
         if (buf_stack->cnt <= 0) {
             /* Need to read from input file */
             buf_stack->cnt = read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
@@ -479,34 +569,50 @@ static char *readline()
             if (buf_stack->cnt <= 0) {
                 /* Encountered EOF */
                 pop_file();
-                if (cnt > 0) {
-                    /* Last line of file did not terminate with newline. */
-                    /*  Terminate line & return it */
-                    *lptr++ = '\n';
-                    *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
-                    return linebuf;
-                }
-                return NULL;
+                return cnt;
             }
         }
 
         /* Have text in buffer */
-        c = *buf_stack->bufptr++;
-        *lptr++ = c;
-        buf_stack->cnt--;
-        if (c == '\n')
+        size_t avail = buf_stack->cnt;
+        if (avail > max - cnt)
+            avail = max - cnt;
+        char *nl = memchr(buf_stack->bufptr, '\n', avail);
+        size_t len = nl ? (size_t) (nl - buf_stack->bufptr) + 1 : avail;
+        memcpy(linebuf + cnt, buf_stack->bufptr, len);
+        buf_stack->bufptr += len;
+        buf_stack->cnt -= len;
+        cnt += len;
+        if (nl)
             break;
     }
+    return cnt;
+}
+
+/* Read command from input file.
+ * When hit EOF, close that file and return NULL
+ */
+static char *readline()
+{
+    size_t len;
+
+    if (!buf_stack)
+        return NULL;
+
+    if (buf_stack->map)
+        len = read_mapped(RIO_BUFSIZE - 2);
+    else
+        len = read_buffered(RIO_BUFSIZE - 2);
+    if (len == 0)
+        return NULL;
 
-    if (c != '\n') {
-        /* Hit buffer limit.  Artificially terminate line */
-        *lptr++ = '\n';
+    if (linebuf[len - 1] != '\n') {
+        /* Last line of file did not terminate with newline, or hit buffer
+         * limit.  Artificially terminate line
+         */
+        linebuf[len++] = '\n';
     }
-    *lptr++ = '\0';
+    linebuf[len] = '\0';
 
     if (echo) {
         report_noreturn(1, prompt);
@@ -542,6 +648,16 @@ int cmd_select(int nfds,
     if (cmd_done())
         return 0;
 
+    /* A mapped file is always ready, no need to wait unless there is also
+     * network activity to watch
+     */
+    if (!block_flag && buf_stack->map && nfds == 0) {
+        char *cmdline = readline();
+        if (cmdline)
+            interpret_cmd(cmdline);
+        return 0;
+    }
+
     if (!block_flag) {
         /* Process any commands in input buffer */
         if (!readfds)
@@ -641,9 +757,10 @@ bool run_console(char *infile_name)
     if (!has_infile) {
         char *cmdline;
         while ((cmdline = linenoise(prompt)) != NULL) {
-            interpret_cmd(cmdline);
+            /* before the line gets split up by interpret_cmd() */
             linenoiseHistoryAdd(cmdline);       /* Add to the history. */
             linenoiseHistorySave(HISTORY_FILE); /* Save the history on disk. */
+            interpret_cmd(cmdline);
             linenoiseFree(cmdline);
             while (buf_stack && buf_stack->fd != STDIN_FILENO)
                 cmd_select(0, NULL, NULL, NULL, NULL);
@@ -656,3 +773,116 @@ bool run_console(char *infile_name)
 
     return err_cnt == 0;
 }
+
+/* Binary traces, as written by scripts/trace2bin.py.  All the fields are
+ * 32-bit little-endian words:
+ *
+ *   "QTB1", size of the string table, number of records
+ *   string table: NUL-terminated strings, padded to a multiple of 4 bytes
+ *   records: repeat count, argc, then argc offsets into the string table
+ *
+ * The first string of a record is the command name.
+ */
+#define TRACE_MAGIC "QTB1"
+#define TRACE_HEADER 3
+
+/* Check every record fits in the file and refers to strings of the table,
+ * return the number of records or -1 if the trace is malformed
+ */
+static long check_trace(uint32_t *words, size_t nwords)
+{
+    if (nwords < TRACE_HEADER || memcmp(words, TRACE_MAGIC, 4))
+        return -1;
+
+    uint32_t table_size = words[1];
+    char *table = (char *) (words + TRACE_HEADER);
+    if (table_size % 4 || table_size / 4 > nwords - TRACE_HEADER ||
+        (table_size && table[table_size - 1] != '\0'))
+        return -1;
+
+    size_t pos = TRACE_HEADER + table_size / 4;
+    for (uint32_t r = 0; r < words[2]; r++) {
+        if (nwords - pos < 2)
+            return -1;
+        uint32_t argc = words[pos + 1];
+        pos += 2;
+        if (argc == 0 || argc > MAX_ARGS || argc > nwords - pos)
+            return -1;
+        for (uint32_t i = 0; i < argc; i++)
+            if (words[pos + i] >= table_size)
+                return -1;
+        pos += argc;
+    }
+    return words[2];
+}
+
+static char *trace_argv[MAX_ARGS];
+
+/* Run the commands of a binary trace.  Every command is looked up once per
+ * record and called straight with its arguments, without reading, splitting
+ * or echoing lines unless echo is on.
+ */
+bool run_binary_trace(char *fname)
+{
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        report(1, "ERROR: Could not open binary trace '%s'", fname);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    if (st.st_size < TRACE_HEADER * 4) {
+        report(1, "ERROR: Malformed binary trace '%s'", fname);
+        close(fd);
+        return false;
+    }
+
+    /* private and writable, in case a command modifies its arguments */
+    uint32_t *words = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (words == MAP_FAILED) {
+        report(1, "ERROR: Could not open binary trace '%s'", fname);
+        return false;
+    }
+
+    long nrecords = check_trace(words, st.st_size / 4);
+    if (nrecords < 0) {
+        report(1, "ERROR: Malformed binary trace '%s'", fname);
+        munmap(words, st.st_size);
+        return false;
+    }
+
+    has_infile = true;
+    char *table = (char *) (words + TRACE_HEADER);
+    uint32_t *rec = words + TRACE_HEADER + words[1] / 4;
+    for (long r = 0; r < nrecords && !quit_flag; r++) {
+        uint32_t repeat = rec[0], argc = rec[1];
+        uint32_t *args = rec + 2;
+        rec = args + argc;
+
+        cmd_ptr cmd = find_cmd(table + args[0]);
+        for (uint32_t n = 0; n < repeat && !quit_flag; n++) {
+            /* rebuilt every time, a command may have shuffled them */
+            for (uint32_t i = 0; i < argc; i++)
+                trace_argv[i] = table + args[i];
+
+            if (echo) {
+                report_noreturn(1, prompt);
+                for (uint32_t i = 0; i < argc; i++)
+                    report_noreturn(1, i + 1 < argc ? "%s " : "%s\n",
+                                    trace_argv[i]);
+            }
+
+            run_cmd(cmd, argc, trace_argv);
+
+            /* files pushed by 'source' */
+            while (!cmd_done())
+                cmd_select(0, NULL, NULL, NULL, NULL);
+        }
+    }
+
+    munmap(words, st.st_size);
+    return err_cnt == 0;
+}
@@ -16,13 +16,16 @@ typedef bool (*cmd_function)(int argc, char *argv[]);
 
 /* Information about each command */
 
-/* Organized as linked list in alphabetical order */
+/* Organized as linked list in alphabetical order, and chained by hash_next in
+ * a hash table of the names for lookups
+ */
 typedef struct CELE cmd_ele, *cmd_ptr;
 struct CELE {
     char *name;
     cmd_function operation;
     char *documentation;
     cmd_ptr next;
+    cmd_ptr hash_next;
 };
 
 /* Optionally supply function that gets invoked when parameter changes */
@@ -58,6 +61,9 @@ bool get_int(char *vname, int *loc);
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_function qf);
 
+/* Set function to be executed after every command, with its arguments */
+void set_post_cmd_helper(cmd_function pf);
+
 /* Turn echoing on/off */
 void set_echo(bool on);
 
@@ -79,6 +85,9 @@ int cmd_select(int nfds,
  */
 bool run_console(char *infile_name);
 
+/* Run the commands of a binary trace made by scripts/trace2bin.py */
+bool run_binary_trace(char *fname);
+
 /* Callback function to complete command by linenoise */
 void completion(const char *buf, linenoiseCompletions *lc);
 
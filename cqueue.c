@@ -0,0 +1,602 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cqueue.h"
+#include "harness.h"
+#include "random.h"
+
+/* Offsets held by every block of the map, a power of two */
+#define CQ_BLOCK_SIZE 1024
+
+/* Entries of the smallest map */
+#define CQ_MIN_MAP 8
+
+/* Size of the smallest arena */
+#define CQ_MIN_ARENA 4096
+
+/* Size of the largest arena, so that every offset fits in 32 bits */
+#define CQ_MAX_ARENA ((size_t) UINT32_MAX)
+
+/* Runs sorted by insertion before cq_sort() starts merging */
+#define CQ_SORT_RUN 16
+
+/*
+ * Positions count offsets over all blocks of the map, so the i-th string
+ * from the head sits at position first + i.  Exactly the blocks holding at
+ * least one queued offset are allocated.
+ */
+struct cqueue {
+    uint32_t **map;    /* blocks of offsets, NULL where nothing is queued */
+    size_t map_size;   /* number of entries in map */
+    size_t first;      /* position of the head */
+    size_t count;      /* number of queued strings */
+    char *arena;       /* null-terminated strings, queued or removed */
+    size_t arena_used; /* bytes taken at the start of arena */
+    size_t arena_cap;  /* size of arena */
+    size_t arena_live; /* bytes taken by queued strings */
+};
+
+/* Get the offset slot at position pos, its block must be allocated */
+static inline uint32_t *slot(const cqueue_t *q, size_t pos)
+{
+    return &q->map[pos / CQ_BLOCK_SIZE][pos % CQ_BLOCK_SIZE];
+}
+
+/* Get the i-th string from the head */
+static inline char *str(const cqueue_t *q, size_t i)
+{
+    return q->arena + *slot(q, q->first + i);
+}
+
+/* Create an empty compact queue */
+cqueue_t *cq_new()
+{
+    cqueue_t *q = malloc(sizeof(cqueue_t));
+    if (!q)
+        return NULL;
+
+    q->map = malloc(CQ_MIN_MAP * sizeof(uint32_t *));
+    if (!q->map) {
+        free(q);
+        return NULL;
+    }
+    memset(q->map, 0, CQ_MIN_MAP * sizeof(uint32_t *));
+    q->map_size = CQ_MIN_MAP;
+    q->first = CQ_MIN_MAP * CQ_BLOCK_SIZE / 2;
+    q->count = 0;
+
+    q->arena = NULL;
+    q->arena_used = 0;
+    q->arena_cap = 0;
+    q->arena_live = 0;
+
+    return q;
+}
+
+/* Free all storage used by queue */
+void cq_free(cqueue_t *q)
+{
+    if (!q)
+        return;
+
+    for (size_t i = 0; i < q->map_size; i++)
+        free(q->map[i]);
+    free(q->map);
+    free(q->arena);
+    free(q);
+}
+
+/*
+ * Make room for one more position before the head and after the tail.
+ * The allocated blocks are recentered in a map of the same size if that
+ * leaves at least half of it free, otherwise in a map twice as large.
+ *
+ * Return false if failed to allocate the new map.
+ */
+static bool map_reserve(cqueue_t *q)
+{
+    size_t lo = q->first / CQ_BLOCK_SIZE, nblocks = 0;
+    size_t size = q->map_size;
+    uint32_t **map;
+
+    if (q->count)
+        nblocks = (q->first + q->count - 1) / CQ_BLOCK_SIZE - lo + 1;
+    if (2 * (nblocks + 1) > size)
+        size *= 2;
+
+    map = malloc(size * sizeof(uint32_t *));
+    if (!map)
+        return false;
+    memset(map, 0, size * sizeof(uint32_t *));
+
+    size_t new_lo = (size - nblocks) / 2;
+    memcpy(map + new_lo, q->map + lo, nblocks * sizeof(uint32_t *));
+    free(q->map);
+
+    q->map = map;
+    q->map_size = size;
+    q->first = new_lo * CQ_BLOCK_SIZE + q->first % CQ_BLOCK_SIZE;
+
+    return true;
+}
+
+/*
+ * Make sure size more bytes fit at the end of the arena.  If they do not,
+ * the queued strings are copied into a new arena leaving at least as much
+ * free space as they take, which also drops all strings removed meanwhile.
+ *
+ * Return false if failed to allocate the new arena or it would be too large.
+ */
+static bool arena_reserve(cqueue_t *q, size_t size)
+{
+    size_t need, cap = CQ_MIN_ARENA, used = 0;
+    char *arena;
+
+    if (q->arena_cap - q->arena_used >= size)
+        return true;
+
+    need = q->arena_live + size;
+    if (need > CQ_MAX_ARENA)
+        return false;
+    while (cap < 2 * need)
+        cap *= 2;
+    if (cap > CQ_MAX_ARENA)
+        cap = CQ_MAX_ARENA;
+
+    arena = malloc(cap);
+    if (!arena)
+        return false;
+
+    for (size_t i = 0; i < q->count; i++) {
+        uint32_t *off = slot(q, q->first + i);
+        size_t len = strlen(q->arena + *off) + 1;
+        memcpy(arena + used, q->arena + *off, len);
+        *off = used;
+        used += len;
+    }
+    free(q->arena);
+
+    q->arena = arena;
+    q->arena_used = used;
+    q->arena_cap = cap;
+
+    return true;
+}
+
+/* Insert a copy of s right before the head or right after the tail */
+static bool cq_insert(cqueue_t *q, const char *s, bool at_head)
+{
+    size_t size, pos;
+    uint32_t **block;
+
+    if (!q)
+        return false;
+
+    size = strlen(s) + 1;
+    if (!arena_reserve(q, size))
+        return false;
+
+    if (at_head) {
+        if (!q->first && !map_reserve(q))
+            return false;
+        pos = q->first - 1;
+    } else {
+        if (q->first + q->count == q->map_size * CQ_BLOCK_SIZE &&
+            !map_reserve(q))
+            return false;
+        pos = q->first + q->count;
+    }
+
+    block = &q->map[pos / CQ_BLOCK_SIZE];
+    if (!*block) {
+        *block = malloc(CQ_BLOCK_SIZE * sizeof(uint32_t));
+        if (!*block)
+            return false;
+    }
+
+    memcpy(q->arena + q->arena_used, s, size);
+    *slot(q, pos) = q->arena_used;
+    q->arena_used += size;
+    q->arena_live += size;
+
+    if (at_head)
+        q->first--;
+    q->count++;
+
+    return true;
+}
+
+/* Insert an element at head of queue */
+bool cq_insert_head(cqueue_t *q, const char *s)
+{
+    return cq_insert(q, s, true);
+}
+
+/* Insert an element at tail of queue */
+bool cq_insert_tail(cqueue_t *q, const char *s)
+{
+    return cq_insert(q, s, false);
+}
+
+/* Account for the i-th string from the head leaving the arena */
+static void drop_string(cqueue_t *q, size_t i)
+{
+    q->arena_live -= strlen(str(q, i)) + 1;
+}
+
+/* Release the block holding pos once its last queued offset is gone */
+static void release_block(cqueue_t *q, size_t pos)
+{
+    free(q->map[pos / CQ_BLOCK_SIZE]);
+    q->map[pos / CQ_BLOCK_SIZE] = NULL;
+}
+
+/* Take the head position out of the queue, its string is already dropped */
+static void unlink_head(cqueue_t *q)
+{
+    size_t pos = q->first++;
+
+    if (!--q->count || q->first % CQ_BLOCK_SIZE == 0)
+        release_block(q, pos);
+    if (!q->count)
+        q->arena_used = 0;
+}
+
+/* Take the tail position out of the queue, its string is already dropped */
+static void unlink_tail(cqueue_t *q)
+{
+    size_t pos = q->first + --q->count;
+
+    if (!q->count || pos % CQ_BLOCK_SIZE == 0)
+        release_block(q, pos);
+    if (!q->count)
+        q->arena_used = 0;
+}
+
+/* Copy the i-th string from the head into sp, at most bufsize - 1 bytes */
+static void copy_string(const cqueue_t *q, size_t i, char *sp, size_t bufsize)
+{
+    const char *s = str(q, i);
+    size_t len;
+
+    if (!sp || !bufsize)
+        return;
+
+    len = strnlen(s, bufsize - 1);
+    memcpy(sp, s, len);
+    sp[len] = '\0';
+}
+
+/* Remove an element from head of queue */
+bool cq_remove_head(cqueue_t *q, char *sp, size_t bufsize)
+{
+    if (!q || !q->count)
+        return false;
+
+    copy_string(q, 0, sp, bufsize);
+    drop_string(q, 0);
+    unlink_head(q);
+
+    return true;
+}
+
+/* Remove an element from tail of queue */
+bool cq_remove_tail(cqueue_t *q, char *sp, size_t bufsize)
+{
+    if (!q || !q->count)
+        return false;
+
+    copy_string(q, q->count - 1, sp, bufsize);
+    drop_string(q, q->count - 1);
+    unlink_tail(q);
+
+    return true;
+}
+
+/* Get the string at position i */
+char *cq_at(cqueue_t *q, size_t i)
+{
+    if (!q || i >= q->count)
+        return NULL;
+
+    return str(q, i);
+}
+
+/* Return number of elements in queue */
+int cq_size(cqueue_t *q)
+{
+    return q ? q->count : 0;
+}
+
+/* Delete the middle node in queue */
+bool cq_delete_mid(cqueue_t *q)
+{
+    size_t mid;
+
+    if (!q || !q->count)
+        return false;
+
+    mid = q->count / 2;
+    drop_string(q, mid);
+
+    /* close the gap from the head side, it is never the longer one */
+    for (size_t i = mid; i > 0; i--)
+        *slot(q, q->first + i) = *slot(q, q->first + i - 1);
+    unlink_head(q);
+
+    return true;
+}
+
+/* Delete all nodes that have duplicate string */
+bool cq_delete_dup(cqueue_t *q)
+{
+    size_t i = 0, kept = 0;
+
+    if (!q)
+        return false;
+
+    /* keep the runs of a single string, packed towards the head */
+    while (i < q->count) {
+        size_t j = i + 1;
+        while (j < q->count && !strcmp(str(q, i), str(q, j)))
+            j++;
+
+        if (j - i == 1) {
+            *slot(q, q->first + kept++) = *slot(q, q->first + i);
+        } else {
+            for (size_t k = i; k < j; k++)
+                drop_string(q, k);
+        }
+        i = j;
+    }
+
+    while (q->count > kept)
+        unlink_tail(q);
+
+    return true;
+}
+
+/* Slot of the string table of cq_delete_dup_unsorted() */
+struct cq_dup_slot {
+    uint64_t hash;
+    uint32_t off;  /* offset of the first occurrence in the arena */
+    uint32_t seen; /* number of occurrences, 0 if the slot is unused */
+};
+
+/* 64-bit FNV-1a hash of a string */
+static uint64_t str_hash(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (; *s; s++)
+        h = (h ^ (unsigned char) *s) * 0x100000001b3ULL;
+    return h;
+}
+
+/* Find the table slot of string s, or the unused slot it would go into */
+static struct cq_dup_slot *dup_lookup(const cqueue_t *q,
+                                      struct cq_dup_slot *table,
+                                      size_t mask,
+                                      const char *s)
+{
+    uint64_t hash = str_hash(s);
+    size_t i = hash & mask;
+
+    while (table[i].seen &&
+           (table[i].hash != hash || strcmp(q->arena + table[i].off, s)))
+        i = (i + 1) & mask;
+    table[i].hash = hash;
+
+    return &table[i];
+}
+
+/* Delete all nodes whose string appears more than once, in any position */
+bool cq_delete_dup_unsorted(cqueue_t *q)
+{
+    struct cq_dup_slot *table;
+    size_t nslots = 2, mask, kept = 0;
+
+    if (!q)
+        return false;
+
+    if (q->count < 2)
+        return true;
+
+    while (nslots < 2 * q->count)
+        nslots <<= 1;
+    mask = nslots - 1;
+    table = malloc(nslots * sizeof(struct cq_dup_slot));
+    if (!table)
+        return false;
+    memset(table, 0, nslots * sizeof(struct cq_dup_slot));
+
+    /* Removed strings stay in the arena until the next insertion, so the
+     * table can refer to them there instead of keeping its own copies.
+     */
+    for (size_t i = 0; i < q->count; i++) {
+        struct cq_dup_slot *s = dup_lookup(q, table, mask, str(q, i));
+        if (!s->seen++)
+            s->off = *slot(q, q->first + i);
+    }
+
+    for (size_t i = 0; i < q->count; i++) {
+        if (dup_lookup(q, table, mask, str(q, i))->seen == 1)
+            *slot(q, q->first + kept++) = *slot(q, q->first + i);
+        else
+            drop_string(q, i);
+    }
+    free(table);
+
+    while (q->count > kept)
+        unlink_tail(q);
+
+    return true;
+}
+
+/* Exchange the offsets of the i-th and j-th strings from the head */
+static inline void swap_at(cqueue_t *q, size_t i, size_t j)
+{
+    uint32_t *a = slot(q, q->first + i), *b = slot(q, q->first + j);
+    uint32_t tmp = *a;
+
+    *a = *b;
+    *b = tmp;
+}
+
+/* Swap every two adjacent nodes */
+void cq_swap(cqueue_t *q)
+{
+    if (!q)
+        return;
+
+    for (size_t i = 0; i + 1 < q->count; i += 2)
+        swap_at(q, i, i + 1);
+}
+
+/* Reverse elements in queue */
+void cq_reverse(cqueue_t *q)
+{
+    if (!q || !q->count)
+        return;
+
+    for (size_t i = 0, j = q->count - 1; i < j; i++, j--)
+        swap_at(q, i, j);
+}
+
+/* Offset of a string paired with its big-endian prefix, as sorted */
+struct cq_sort_item {
+    uint64_t key;
+    uint32_t off;
+};
+
+/* Get the first 8 bytes of s in big-endian order, padded with zeros */
+static inline uint64_t key_prefix(const char *s)
+{
+    uint64_t key = 0;
+
+    for (size_t i = 0; i < sizeof(key) && s[i]; i++)
+        key |= (uint64_t) (unsigned char) s[i] << (8 * (sizeof(key) - 1 - i));
+
+    return key;
+}
+
+/* Compare two sort items, strcmp() only breaks ties of long prefixes */
+static inline int item_cmp(const char *arena,
+                           const struct cq_sort_item *a,
+                           const struct cq_sort_item *b)
+{
+    if (a->key != b->key)
+        return a->key < b->key ? -1 : 1;
+
+    /* both strings ended within the prefix */
+    if (!(a->key & 0xff))
+        return 0;
+
+    return strcmp(arena + a->off + sizeof(a->key),
+                  arena + b->off + sizeof(b->key));
+}
+
+/* Merge the sorted runs src[lo, mid) and src[mid, hi) into dst[lo, hi) */
+static void merge_items(const char *arena,
+                        const struct cq_sort_item *src,
+                        struct cq_sort_item *dst,
+                        size_t lo,
+                        size_t mid,
+                        size_t hi)
+{
+    size_t i = lo, j = mid, k = lo;
+
+    while (i < mid && j < hi)
+        dst[k++] = item_cmp(arena, &src[j], &src[i]) < 0 ? src[j++] : src[i++];
+    while (i < mid)
+        dst[k++] = src[i++];
+    while (j < hi)
+        dst[k++] = src[j++];
+}
+
+/* Move the i-th string down the max-heap of the first n strings */
+static void sift_down(cqueue_t *q, size_t i, size_t n)
+{
+    for (size_t child; (child = 2 * i + 1) < n; i = child) {
+        if (child + 1 < n && strcmp(str(q, child), str(q, child + 1)) < 0)
+            child++;
+        if (strcmp(str(q, i), str(q, child)) >= 0)
+            break;
+        swap_at(q, i, child);
+    }
+}
+
+/* Heapsort the offsets in place, when no scratch memory is available */
+static void heap_sort(cqueue_t *q)
+{
+    size_t n = q->count;
+
+    for (size_t i = n / 2; i > 0; i--)
+        sift_down(q, i - 1, n);
+    while (--n > 0) {
+        swap_at(q, 0, n);
+        sift_down(q, 0, n);
+    }
+}
+
+/* Sort elements of queue in ascending order */
+void cq_sort(cqueue_t *q)
+{
+    struct cq_sort_item *items, *src, *dst;
+    size_t n;
+
+    if (!q || q->count < 2)
+        return;
+
+    n = q->count;
+    items = malloc(2 * n * sizeof(struct cq_sort_item));
+    if (!items) {
+        heap_sort(q);
+        return;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        items[i].off = *slot(q, q->first + i);
+        items[i].key = key_prefix(q->arena + items[i].off);
+    }
+
+    /* insertion sort short runs, then merge them bottom-up, both stable */
+    for (size_t lo = 0; lo < n; lo += CQ_SORT_RUN) {
+        size_t hi = lo + CQ_SORT_RUN < n ? lo + CQ_SORT_RUN : n;
+        for (size_t i = lo + 1; i < hi; i++) {
+            struct cq_sort_item tmp = items[i];
+            size_t j = i;
+            for (; j > lo && item_cmp(q->arena, &tmp, &items[j - 1]) < 0; j--)
+                items[j] = items[j - 1];
+            items[j] = tmp;
+        }
+    }
+
+    src = items;
+    dst = items + n;
+    for (size_t width = CQ_SORT_RUN; width < n; width *= 2) {
+        for (size_t lo = 0; lo < n; lo += 2 * width) {
+            size_t mid = lo + width < n ? lo + width : n;
+            size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+            merge_items(q->arena, src, dst, lo, mid, hi);
+        }
+        struct cq_sort_item *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    for (size_t i = 0; i < n; i++)
+        *slot(q, q->first + i) = src[i].off;
+    free(items);
+}
+
+/* Shuffle the queue uniformly at random */
+void cq_shuffle(cqueue_t *q)
+{
+    if (!q)
+        return;
+
+    for (size_t i = q->count; i > 1; i--)
+        swap_at(q, i - 1, prng_bounded(i));
+}
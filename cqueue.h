@@ -0,0 +1,149 @@
+#ifndef LAB0_CQUEUE_H
+#define LAB0_CQUEUE_H
+
+/* Compact queue, a second implementation of the operations in queue.h.
+ *
+ * Instead of one list node per string, it keeps a chunked ring buffer (a
+ * deque of fixed-size blocks) of 32-bit offsets into an append-only string
+ * arena.  Scans touch contiguous memory, and no operation chases pointers.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct cqueue cqueue_t;
+
+/**
+ * cq_new() - Create an empty compact queue
+ *
+ * Return: NULL for allocation failed
+ */
+cqueue_t *cq_new();
+
+/**
+ * cq_free() - Free all storage used by queue, no effect if queue is NULL
+ * @q: the queue
+ */
+void cq_free(cqueue_t *q);
+
+/**
+ * cq_insert_head() - Insert a copy of a string at the head of the queue
+ * @q: the queue
+ * @s: string would be inserted
+ *
+ * Takes amortized constant time in the number of strings queued.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool cq_insert_head(cqueue_t *q, const char *s);
+
+/**
+ * cq_insert_tail() - Insert a copy of a string at the tail of the queue
+ * @q: the queue
+ * @s: string would be inserted
+ *
+ * Takes amortized constant time in the number of strings queued.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool cq_insert_tail(cqueue_t *q, const char *s);
+
+/**
+ * cq_remove_head() - Remove the string at the head of the queue
+ * @q: the queue
+ * @sp: buffer the removed string is copied into, may be NULL
+ * @bufsize: size of @sp
+ *
+ * At most @bufsize - 1 characters are copied, followed by a null terminator.
+ *
+ * Return: true for success, false if queue is NULL or empty
+ */
+bool cq_remove_head(cqueue_t *q, char *sp, size_t bufsize);
+
+/**
+ * cq_remove_tail() - Remove the string at the tail of the queue
+ * @q: the queue
+ * @sp: buffer the removed string is copied into, may be NULL
+ * @bufsize: size of @sp
+ *
+ * Return: true for success, false if queue is NULL or empty
+ */
+bool cq_remove_tail(cqueue_t *q, char *sp, size_t bufsize);
+
+/**
+ * cq_at() - Get the string at a given position of the queue
+ * @q: the queue
+ * @i: position counted from the head, 0 for the head itself
+ *
+ * The returned string lives in the arena of the queue, and it moves when a
+ * later insertion compacts the arena.
+ *
+ * Return: the string, NULL if queue is NULL or @i is out of range
+ */
+char *cq_at(cqueue_t *q, size_t i);
+
+/**
+ * cq_size() - Get the number of strings in the queue
+ * @q: the queue
+ *
+ * Return: the number of strings, zero if queue is NULL or empty
+ */
+int cq_size(cqueue_t *q);
+
+/**
+ * cq_delete_mid() - Delete the middle string of the queue
+ * @q: the queue
+ *
+ * The middle is the same as of q_delete_mid(), at position size / 2.
+ *
+ * Return: true for success, false if queue is NULL or empty
+ */
+bool cq_delete_mid(cqueue_t *q);
+
+/**
+ * cq_delete_dup() - Delete all strings appearing more than once in a row
+ * @q: the queue, usually sorted
+ *
+ * Return: true for success, false if queue is NULL
+ */
+bool cq_delete_dup(cqueue_t *q);
+
+/**
+ * cq_delete_dup_unsorted() - Delete all strings appearing more than once
+ *                            anywhere, keeping the order of the others
+ * @q: the queue
+ *
+ * Return: true for success, false if queue is NULL or the table could not be
+ * allocated
+ */
+bool cq_delete_dup_unsorted(cqueue_t *q);
+
+/**
+ * cq_swap() - Swap every two adjacent strings
+ * @q: the queue
+ */
+void cq_swap(cqueue_t *q);
+
+/**
+ * cq_reverse() - Reverse the strings of the queue, without allocating
+ * @q: the queue
+ */
+void cq_reverse(cqueue_t *q);
+
+/**
+ * cq_sort() - Sort the strings of the queue in ascending order
+ * @q: the queue
+ *
+ * The offsets are merge sorted in a contiguous scratch array, which is
+ * released before returning.  If the scratch array could not be allocated,
+ * they are heapsorted in place instead, which is not stable.
+ */
+void cq_sort(cqueue_t *q);
+
+/**
+ * cq_shuffle() - Shuffle the strings of the queue with Fisher-Yates
+ * @q: the queue
+ */
+void cq_shuffle(cqueue_t *q);
+
+#endif /* LAB0_CQUEUE_H */
@@ -16,17 +16,11 @@
 const size_t chunk_size = 16;
 
 /* Number of measurements per test */
-const size_t n_measure = N_MEASURE;
+int n_measure = N_MEASURE;
 
 const int drop_size = 20;
 
-/* Maintain a queue independent from the qtest since
- * we do not want the test to affect the original functionality
- */
-static struct list_head *l = NULL;
-
-static char random_string[N_MEASURE][8];
-static int random_string_iter = 0;
+int measure_prebuilt = 0;
 
 enum {
     test_insert_head,
@@ -35,35 +29,133 @@ enum {
     test_remove_tail,
 };
 
-/* Implement the necessary queue interface to simulation */
-void init_dut(void)
+/* Implement the necessary queue interface to simulation.
+ * Every measuring thread maintains a queue independent from the qtest since
+ * we do not want the test to affect the original functionality.
+ *
+ * Return false if failed to allocate the random strings or the queues.
+ * free_dut() is to be called either way.
+ */
+bool init_dut(dut_t *dut)
 {
-    l = NULL;
+    dut->l = NULL;
+    dut->random_string_iter = 0;
+    dut->random_string = malloc(n_measure * sizeof(*dut->random_string));
+    dut->queues = calloc(n_measure, sizeof(*dut->queues));
+    return dut->random_string && dut->queues;
 }
 
-char *get_random_string(void)
+void free_dut(dut_t *dut)
 {
-    random_string_iter = (random_string_iter + 1) % N_MEASURE;
-    return random_string[random_string_iter];
+    free(dut->random_string);
+    free(dut->queues);
+    dut->random_string = NULL;
+    dut->queues = NULL;
 }
 
-void prepare_inputs(uint8_t *input_data, uint8_t *classes)
+static char *get_random_string(dut_t *dut)
 {
-    randombytes(input_data, n_measure * chunk_size);
+    dut->random_string_iter = (dut->random_string_iter + 1) % n_measure;
+    return dut->random_string[dut->random_string_iter];
+}
+
+void prepare_inputs(dut_t *dut, uint8_t *input_data, uint8_t *classes)
+{
+    prng_fill(input_data, n_measure * chunk_size);
     for (size_t i = 0; i < n_measure; i++) {
         classes[i] = randombit();
         if (classes[i] == 0)
             memset(input_data + (size_t) i * chunk_size, 0, chunk_size);
     }
 
-    for (size_t i = 0; i < N_MEASURE; ++i) {
+    for (size_t i = 0; i < n_measure; ++i) {
         /* Generate random string */
-        randombytes((uint8_t *) random_string[i], 7);
-        random_string[i][7] = 0;
+        prng_fill(dut->random_string[i], 7);
+        dut->random_string[i][7] = 0;
+    }
+}
+
+/*
+ * Build the queue of every measurement of the batch up front, all of them
+ * pooled.  A slot is left released in each pool, so that the insertions
+ * measured do not allocate a slab either.
+ */
+static void build_queues(dut_t *dut, uint8_t *input_data)
+{
+    for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+        int n = *(uint16_t *) (input_data + i * chunk_size) % 10000;
+        struct list_head *l = q_new_pooled();
+
+        for (int j = 0; j <= n; j++)
+            q_insert_head(l, get_random_string(dut));
+        element_t *e = q_remove_head(l, NULL, 0);
+        if (e)
+            q_release_element(e);
+        dut->queues[i] = l;
+    }
+}
+
+static void free_queues(dut_t *dut)
+{
+    for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+        q_free(dut->queues[i]);
+        dut->queues[i] = NULL;
+    }
+}
+
+/* Measure on queues built up front, timing nothing but the operation */
+static void measure_prebuilt_queues(dut_t *dut,
+                                    int64_t *before_ticks,
+                                    int64_t *after_ticks,
+                                    uint8_t *input_data,
+                                    int mode)
+{
+    element_t *e;
+
+    build_queues(dut, input_data);
+
+    switch (mode) {
+    case test_insert_head:
+        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+            char *s = get_random_string(dut);
+            before_ticks[i] = cpucycles();
+            q_insert_head(dut->queues[i], s);
+            after_ticks[i] = cpucycles();
+        }
+        break;
+    case test_insert_tail:
+        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+            char *s = get_random_string(dut);
+            before_ticks[i] = cpucycles();
+            q_insert_tail(dut->queues[i], s);
+            after_ticks[i] = cpucycles();
+        }
+        break;
+    case test_remove_head:
+        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+            before_ticks[i] = cpucycles();
+            e = q_remove_head(dut->queues[i], NULL, 0);
+            after_ticks[i] = cpucycles();
+            if (e)
+                q_release_element(e);
+        }
+        break;
+    case test_remove_tail:
+        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+            before_ticks[i] = cpucycles();
+            e = q_remove_tail(dut->queues[i], NULL, 0);
+            after_ticks[i] = cpucycles();
+            if (e)
+                q_release_element(e);
+        }
+        break;
     }
+
+    free_queues(dut);
 }
 
-void measure(int64_t *before_ticks,
+void measure(dut_t *dut,
+             int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
              int mode)
@@ -71,71 +163,77 @@ void measure(int64_t *before_ticks,
     assert(mode == test_insert_head || mode == test_insert_tail ||
            mode == test_remove_head || mode == test_remove_tail);
 
+    if (measure_prebuilt) {
+        measure_prebuilt_queues(dut, before_ticks, after_ticks, input_data,
+                                mode);
+        return;
+    }
+
     switch (mode) {
     case test_insert_head:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            char *s = get_random_string();
-            dut_new();
+            char *s = get_random_string(dut);
+            dut_new(dut);
             dut_insert_head(
-                get_random_string(),
+                dut, get_random_string(dut),
                 *(uint16_t *) (input_data + i * chunk_size) % 10000);
             before_ticks[i] = cpucycles();
-            dut_insert_head(s, 1);
+            dut_insert_head(dut, s, 1);
             after_ticks[i] = cpucycles();
-            dut_free();
+            dut_free(dut);
         }
         break;
     case test_insert_tail:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            char *s = get_random_string();
-            dut_new();
+            char *s = get_random_string(dut);
+            dut_new(dut);
             dut_insert_head(
-                get_random_string(),
+                dut, get_random_string(dut),
                 *(uint16_t *) (input_data + i * chunk_size) % 10000);
             before_ticks[i] = cpucycles();
-            dut_insert_tail(s, 1);
+            dut_insert_tail(dut, s, 1);
             after_ticks[i] = cpucycles();
-            dut_free();
+            dut_free(dut);
         }
         break;
     case test_remove_head:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
+            dut_new(dut);
             dut_insert_head(
-                get_random_string(),
+                dut, get_random_string(dut),
                 *(uint16_t *) (input_data + i * chunk_size) % 10000);
             before_ticks[i] = cpucycles();
-            element_t *e = q_remove_head(l, NULL, 0);
+            element_t *e = q_remove_head(dut->l, NULL, 0);
             after_ticks[i] = cpucycles();
             if (e)
                 q_release_element(e);
-            dut_free();
+            dut_free(dut);
         }
         break;
     case test_remove_tail:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
+            dut_new(dut);
             dut_insert_head(
-                get_random_string(),
+                dut, get_random_string(dut),
                 *(uint16_t *) (input_data + i * chunk_size) % 10000);
             before_ticks[i] = cpucycles();
-            element_t *e = q_remove_tail(l, NULL, 0);
+            element_t *e = q_remove_tail(dut->l, NULL, 0);
             after_ticks[i] = cpucycles();
             if (e)
                 q_release_element(e);
-            dut_free();
+            dut_free(dut);
         }
         break;
     default:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
+            dut_new(dut);
             dut_insert_head(
-                get_random_string(),
+                dut, get_random_string(dut),
                 *(uint16_t *) (input_data + i * chunk_size) % 10000);
             before_ticks[i] = cpucycles();
-            dut_size(1);
+            dut_size(dut, 1);
             after_ticks[i] = cpucycles();
-            dut_free();
+            dut_free(dut);
         }
     }
 }
@@ -1,34 +1,57 @@
 #ifndef DUDECT_CONSTANT_H
 #define DUDECT_CONSTANT_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
-#define dut_new() ((void) (l = q_new()))
 
-#define dut_size(n)                                \
+struct list_head;
+
+/* Queue under measurement and its inputs, one per measuring thread */
+typedef struct {
+    struct list_head *l;
+    char (*random_string)[8]; /* one random string per measurement */
+    int random_string_iter;
+    struct list_head **queues; /* queues built up front, one per measurement */
+} dut_t;
+
+#define dut_new(d) ((void) ((d)->l = q_new()))
+
+#define dut_size(d, n)                             \
     do {                                           \
         for (int __iter = 0; __iter < n; ++__iter) \
-            q_size(l);                             \
+            q_size((d)->l);                        \
     } while (0)
 
-#define dut_insert_head(s, n)    \
-    do {                         \
-        int j = n;               \
-        while (j--)              \
-            q_insert_head(l, s); \
+#define dut_insert_head(d, s, n)      \
+    do {                              \
+        int j = n;                    \
+        while (j--)                   \
+            q_insert_head((d)->l, s); \
     } while (0)
 
-#define dut_insert_tail(s, n)    \
-    do {                         \
-        int j = n;               \
-        while (j--)              \
-            q_insert_tail(l, s); \
+#define dut_insert_tail(d, s, n)      \
+    do {                              \
+        int j = n;                    \
+        while (j--)                   \
+            q_insert_tail((d)->l, s); \
     } while (0)
 
-#define dut_free() ((void) (q_free(l)))
+#define dut_free(d) ((void) (q_free((d)->l)))
+
+/* Number of measurements per batch, at least 2 * drop_size + 1 */
+extern int n_measure;
+extern const int drop_size;
+extern const size_t chunk_size;
+
+/* Build all queues of a batch from pooled elements before measuring */
+extern int measure_prebuilt;
 
-void init_dut();
-void prepare_inputs(uint8_t *input_data, uint8_t *classes);
-void measure(int64_t *before_ticks,
+bool init_dut(dut_t *dut);
+void free_dut(dut_t *dut);
+void prepare_inputs(dut_t *dut, uint8_t *input_data, uint8_t *classes);
+void measure(dut_t *dut,
+             int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
              int mode);
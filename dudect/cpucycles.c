@@ -0,0 +1,108 @@
+/**
+ * Backends of cpucycles().
+ *
+ * The time stamp counter is read either bare or serialized, so that the
+ * operation measured stays between the two reads.  Where the counter is not
+ * reliable, in some virtual machines for instance, the cycles or the
+ * instructions of the calling thread can be counted by the kernel instead.
+ *
+ * On Arm, both serialized backends surround the read of the virtual counter
+ * with isb.
+ */
+
+#include "cpucycles.h"
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+/* Number of back-to-back reads the overhead is the least of */
+#define CALIBRATION_ROUNDS 10000
+
+int cpucycles_timer = TIMER_RDTSC;
+int64_t cpucycles_overhead = 0;
+
+/* perf_event_open(2) counter of the thread, -1 if none is opened */
+static __thread int perf_fd = -1;
+
+static bool has_rdtscp(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) &&
+           (edx & (1U << 27));
+#else
+    return true;
+#endif
+}
+
+bool cpucycles_thread_init(void)
+{
+    struct perf_event_attr attr;
+
+    if (cpucycles_timer < TIMER_PERF_CYCLES || perf_fd >= 0)
+        return true;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = cpucycles_timer == TIMER_PERF_CYCLES
+                      ? PERF_COUNT_HW_CPU_CYCLES
+                      : PERF_COUNT_HW_INSTRUCTIONS;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    /* count the calling thread, on whichever CPU it runs */
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    return perf_fd >= 0;
+}
+
+void cpucycles_thread_exit(void)
+{
+    if (perf_fd >= 0)
+        close(perf_fd);
+    perf_fd = -1;
+}
+
+int64_t cpucycles_perf(void)
+{
+    int64_t count;
+
+    if (read(perf_fd, &count, sizeof(count)) != sizeof(count))
+        return 0;
+    return count;
+}
+
+bool cpucycles_select(int timer)
+{
+    int old_timer = cpucycles_timer;
+    int64_t least = INT64_MAX;
+
+    if (timer < TIMER_RDTSC || timer > TIMER_PERF_INSTRUCTIONS)
+        return false;
+    if (timer == TIMER_RDTSCP && !has_rdtscp())
+        return false;
+
+    /* a counter opened for the previous backend counts something else */
+    cpucycles_thread_exit();
+    cpucycles_timer = timer;
+    if (!cpucycles_thread_init()) {
+        cpucycles_timer = old_timer;
+        return false;
+    }
+
+    for (int i = 0; i < CALIBRATION_ROUNDS; i++) {
+        int64_t before = cpucycles();
+        int64_t after = cpucycles();
+        if (after - before >= 0 && after - before < least)
+            least = after - before;
+    }
+    cpucycles_overhead = least == INT64_MAX ? 0 : least;
+    cpucycles_thread_exit();
+
+    return true;
+}
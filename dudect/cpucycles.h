@@ -1,10 +1,76 @@
+#ifndef DUDECT_CPUCYCLES_H
+#define DUDECT_CPUCYCLES_H
+
+#include <stdbool.h>
 #include <stdint.h>
+
+/* Backends of cpucycles(), switched with cpucycles_select() */
+enum {
+    TIMER_RDTSC,             /* bare time stamp counter */
+    TIMER_LFENCE,            /* time stamp counter fenced with lfence */
+    TIMER_RDTSCP,            /* rdtscp, fenced with lfence afterwards */
+    TIMER_PERF_CYCLES,       /* cycles counted by perf_event_open(2) */
+    TIMER_PERF_INSTRUCTIONS, /* instructions counted by perf_event_open(2) */
+};
+
+/* Backend in use, TIMER_RDTSC by default */
+extern int cpucycles_timer;
+
+/* Least difference between two back-to-back reads of the backend in use */
+extern int64_t cpucycles_overhead;
+
+/**
+ * cpucycles_select() - Switch the backend of cpucycles()
+ * @timer: one of the TIMER_* backends
+ *
+ * The overhead of the backend is measured again, into cpucycles_overhead.
+ *
+ * Return: true for success, false if the backend is not available here
+ */
+bool cpucycles_select(int timer);
+
+/**
+ * cpucycles_thread_init() - Prepare cpucycles() for the calling thread
+ *
+ * The perf_event_open(2) backends count per thread, so every measuring
+ * thread opens its own counter before its first cpucycles(), and closes it
+ * with cpucycles_thread_exit().  Nothing to do for the other backends.
+ *
+ * Return: true for success, false if the counter could not be opened
+ */
+bool cpucycles_thread_init(void);
+void cpucycles_thread_exit(void);
+
+/* Read the perf_event_open(2) counter of the calling thread */
+int64_t cpucycles_perf(void);
+
 // http://www.intel.com/content/www/us/en/embedded/training/ia-32-ia-64-benchmark-code-execution-paper.html
 static inline int64_t cpucycles(void)
 {
+    if (cpucycles_timer >= TIMER_PERF_CYCLES)
+        return cpucycles_perf();
+
 #if defined(__i386__) || defined(__x86_64__)
     unsigned int hi, lo;
-    __asm__ volatile("rdtsc\n\t" : "=a"(lo), "=d"(hi));
+    /* Without fences, the queue operation measured may be executed partly
+     * before the first read or after the second one.
+     */
+    switch (cpucycles_timer) {
+    case TIMER_LFENCE:
+        __asm__ volatile("lfence\n\trdtsc\n\tlfence"
+                         : "=a"(lo), "=d"(hi)
+                         :
+                         : "memory");
+        break;
+    case TIMER_RDTSCP:
+        __asm__ volatile("rdtscp\n\tlfence"
+                         : "=a"(lo), "=d"(hi)
+                         :
+                         : "ecx", "memory");
+        break;
+    default:
+        __asm__ volatile("rdtsc\n\t" : "=a"(lo), "=d"(hi));
+    }
     return ((int64_t) lo) | (((int64_t) hi) << 32);
 
 #elif defined(__aarch64__)
@@ -15,9 +81,17 @@ static inline int64_t cpucycles(void)
      * bits wide and it is attributed with the flag 'cap_user_time_short'
      * is true.
      */
-    asm volatile("mrs %0, cntvct_el0" : "=r"(val));
+    if (cpucycles_timer == TIMER_RDTSC)
+        asm volatile("mrs %0, cntvct_el0" : "=r"(val));
+    else
+        asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb"
+                     : "=r"(val)
+                     :
+                     : "memory");
     return val;
 #else
 #error Unsupported Architecture
 #endif
 }
+
+#endif
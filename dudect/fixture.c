@@ -26,9 +26,13 @@
  *    variable time.
  */
 
+#define _GNU_SOURCE
 #include "fixture.h"
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,16 +40,61 @@
 #include "../console.h"
 #include "../random.h"
 #include "constant.h"
+#include "cpucycles.h"
 #include "ttest.h"
 
+/* Our program needs to use regular malloc/free */
+#define INTERNAL 1
+#include "../harness.h"
+
 #define enough_measure 10000
 #define test_tries 10
 
-extern const int drop_size;
-extern const size_t chunk_size;
-extern const size_t n_measure;
+/* The second order test starts once the mean has settled over this many
+ * measurements.
+ */
+#define min_measure 1000
+
+/* Number of thresholds the measurements are cropped at */
+#define n_percentiles 100
+
+/* The uncropped test, one test per percentile, then the second order test */
+#define n_tests (1 + n_percentiles + 1)
+#define second_order (n_tests - 1)
+
+/* Upper bound of threads collecting measurements */
+#define MAX_WORKERS 64
+
+/* CPUs isolated from the scheduler by the isolcpus= boot parameter */
+#define ISOLATED_CPUS "/sys/devices/system/cpu/isolated"
+
+int dudect_threads = 0;
+/* The queue under test is empty for one class and filled for the other, and
+ * the cropped and second order tests are sharp enough to tell the two apart
+ * by the state the harness allocator is left in, so they are only run on
+ * request.  They pass along with measure_prebuilt, which keeps the allocator
+ * out of the way, as trace-17 runs them.
+ */
+int dudect_crop = 0;
+
 static t_ctx *t;
 
+/* Cropping thresholds, computed from a first batch of each constant time
+ * test, which is thrown away.
+ */
+static int64_t percentiles[n_percentiles];
+
+/* Measuring thread, collecting its share of the batches into its own t */
+typedef struct {
+    int mode;
+    int cpu;     /* CPU the thread is pinned to, -1 if it is not pinned */
+    int batches; /* number of batches to measure */
+    bool failed;    /* could not allocate the buffers */
+    bool calibrate; /* measure one batch to set the percentiles from */
+    t_ctx t[n_tests];
+    dut_t dut;
+} worker_t;
+
 /* threshold values for Welch's t-test */
 enum {
     t_threshold_bananas = 500, /* Test failed with overwhelming probability */
@@ -61,11 +110,49 @@ static void differentiate(int64_t *exec_times,
                           const int64_t *before_ticks,
                           const int64_t *after_ticks)
 {
+    /* what is left of an operation not slower than the timer itself is
+     * dropped along with the overflows
+     */
     for (size_t i = 0; i < n_measure; i++)
-        exec_times[i] = after_ticks[i] - before_ticks[i];
+        exec_times[i] = after_ticks[i] - before_ticks[i] - cpucycles_overhead;
+}
+
+static int cmp(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
 }
 
-static void update_statistics(const int64_t *exec_times, uint8_t *classes)
+/*
+ * Set the cropping thresholds from the execution times of a batch.  They
+ * are spread exponentially, keeping from about 7% up to almost all of the
+ * fastest measurements, as the interesting part lies in the right tail.
+ */
+static void prepare_percentiles(const int64_t *exec_times)
+{
+    int64_t *sorted = malloc(n_measure * sizeof(int64_t));
+    size_t n = 0;
+
+    if (!sorted)
+        die();
+
+    for (size_t i = 0; i < n_measure; i++) {
+        /* CPU cycle counter overflowed or dropped measurement */
+        if (exec_times[i] > 0)
+            sorted[n++] = exec_times[i];
+    }
+    qsort(sorted, n, sizeof(int64_t), cmp);
+
+    for (size_t i = 0; i < n_percentiles; i++) {
+        double which = 1 - pow(0.5, 10 * (double) (i + 1) / n_percentiles);
+        percentiles[i] = n ? sorted[(size_t) (which * n)] : 0;
+    }
+    free(sorted);
+}
+
+static void update_statistics(t_ctx *ctx,
+                              const int64_t *exec_times,
+                              uint8_t *classes)
 {
     for (size_t i = 0; i < n_measure; i++) {
         int64_t difference = exec_times[i];
@@ -74,24 +161,66 @@ static void update_statistics(const int64_t *exec_times, uint8_t *classes)
             continue;
 
         /* do a t-test on the execution time */
-        t_push(t, difference, classes[i]);
+        t_push(&ctx[0], difference, classes[i]);
+
+        /* t-test on cropped execution times, for several cropping
+         * thresholds.
+         */
+        for (size_t crop = 0; dudect_crop && crop < n_percentiles; crop++) {
+            if (difference < percentiles[crop])
+                t_push(&ctx[crop + 1], difference, classes[i]);
+        }
+
+        /* second order test, on the squared distance to the mean, once
+         * the mean itself has settled
+         */
+        if (dudect_crop && ctx[0].n[0] + ctx[0].n[1] > min_measure) {
+            double centered = difference - ctx[0].mean[classes[i]];
+            t_push(&ctx[second_order], centered * centered, classes[i]);
+        }
     }
 }
 
+/* Pick the test showing the largest difference between the classes, among
+ * those with enough measurements for a verdict of their own, so that the
+ * many cropped tests cannot fail on a few of them
+ */
+static t_ctx *max_test(void)
+{
+    t_ctx *ret = &t[0];
+    double max = fabs(t_compute(ret));
+
+    for (size_t i = 1; i < n_tests; i++) {
+        if (t[i].n[0] + t[i].n[1] < enough_measure)
+            continue;
+        double x = fabs(t_compute(&t[i]));
+        if (x > max) {
+            max = x;
+            ret = &t[i];
+        }
+    }
+    return ret;
+}
+
 static bool report(void)
 {
-    double max_t = fabs(t_compute(t));
-    double number_traces_max_t = t->n[0] + t->n[1];
-    double max_tau = max_t / sqrt(number_traces_max_t);
+    double number_traces = t[0].n[0] + t[0].n[1];
 
     printf("\033[A\033[2K");
-    printf("meas: %7.2lf M, ", (number_traces_max_t / 1e6));
-    if (number_traces_max_t < enough_measure) {
+    if (number_traces < enough_measure) {
+        printf("meas: %7.2lf M, ", (number_traces / 1e6));
         printf("not enough measurements (%.0f still to go).\n",
-               enough_measure - number_traces_max_t);
+               enough_measure - number_traces);
         return false;
     }
 
+    t_ctx *max = max_test();
+    double max_t = fabs(t_compute(max));
+    double number_traces_max_t = max->n[0] + max->n[1];
+    double max_tau = max_t / sqrt(number_traces_max_t);
+
+    printf("meas: %7.2lf M, ", (number_traces_max_t / 1e6));
+
     /* max_t: the t statistic value
      * max_tau: a t value normalized by sqrt(number of measurements).
      *          this way we can compare max_tau taken with different
@@ -117,56 +246,178 @@ static bool report(void)
     return true;
 }
 
-static bool doit(int mode)
+/* Measure the batches of a worker, pinned to its CPU if it has one */
+static void *doit(void *arg)
 {
+    worker_t *w = arg;
+
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    bool dut_ready = init_dut(&w->dut);
     int64_t *before_ticks = calloc(n_measure + 1, sizeof(int64_t));
     int64_t *after_ticks = calloc(n_measure + 1, sizeof(int64_t));
     int64_t *exec_times = calloc(n_measure, sizeof(int64_t));
     uint8_t *classes = calloc(n_measure, sizeof(uint8_t));
     uint8_t *input_data = calloc(n_measure * chunk_size, sizeof(uint8_t));
 
-    if (!before_ticks || !after_ticks || !exec_times || !classes ||
-        !input_data) {
-        die();
-    }
+    w->failed = !before_ticks || !after_ticks || !exec_times || !classes ||
+                !input_data || !dut_ready || !cpucycles_thread_init();
 
-    prepare_inputs(input_data, classes);
-
-    measure(before_ticks, after_ticks, input_data, mode);
-    differentiate(exec_times, before_ticks, after_ticks);
-    update_statistics(exec_times, classes);
-    bool ret = report();
+    for (size_t i = 0; i < n_tests; i++)
+        t_init(&w->t[i]);
+    for (int i = 0; !w->failed && i < w->batches; i++) {
+        prepare_inputs(&w->dut, input_data, classes);
+        measure(&w->dut, before_ticks, after_ticks, input_data, w->mode);
+        differentiate(exec_times, before_ticks, after_ticks);
+        if (w->calibrate)
+            prepare_percentiles(exec_times);
+        else
+            update_statistics(w->t, exec_times, classes);
+    }
 
+    cpucycles_thread_exit();
+    free_dut(&w->dut);
     free(before_ticks);
     free(after_ticks);
     free(exec_times);
     free(classes);
     free(input_data);
 
-    return ret;
+    return NULL;
+}
+
+/*
+ * Collect the CPUs to measure on: those isolated from the scheduler if
+ * there are any, "2-3,6" say, otherwise none.
+ *
+ * Return the number of CPUs stored in cpus, at most max.
+ */
+static int isolated_cpus(int *cpus, int max)
+{
+    FILE *fp = fopen(ISOLATED_CPUS, "r");
+    int n = 0, lo, hi;
+
+    if (!fp)
+        return 0;
+
+    while (n < max && fscanf(fp, "%d", &lo) == 1) {
+        hi = lo;
+        if (fscanf(fp, "-%d", &hi) != 1)
+            hi = lo;
+        for (int cpu = lo; cpu <= hi && n < max; cpu++)
+            cpus[n++] = cpu;
+        if (fgetc(fp) != ',')
+            break;
+    }
+    fclose(fp);
+
+    return n;
 }
 
-static void init_once(void)
+/*
+ * Measure enough batches for a decision, split among the workers and merged
+ * into t.  One worker per isolated CPU is used unless dudect_threads says
+ * otherwise, and without isolated CPUs a single worker measures right here.
+ */
+static void measure_batches(int mode, int batches)
 {
-    init_dut();
-    t_init(t);
+    static worker_t workers[MAX_WORKERS];
+    pthread_t tid[MAX_WORKERS];
+    bool spawned[MAX_WORKERS] = {false};
+    int cpus[MAX_WORKERS];
+    int ncpus = isolated_cpus(cpus, MAX_WORKERS);
+    int n = dudect_threads > 0 ? dudect_threads : ncpus;
+    sigset_t mask, old_mask;
+
+    if (n < 1)
+        n = 1;
+    if (n > MAX_WORKERS)
+        n = MAX_WORKERS;
+
+    for (int i = 0; i < n; i++) {
+        workers[i].mode = mode;
+        workers[i].cpu = i < ncpus ? cpus[i] : -1;
+        workers[i].batches = batches / n + (i < batches % n);
+        workers[i].calibrate = false;
+    }
+
+    if (n == 1 && workers[0].cpu < 0) {
+        doit(&workers[0]);
+    } else {
+        /* keep the alarm and interrupts to the thread running commands */
+        sigfillset(&mask);
+        sigdelset(&mask, SIGSEGV);
+        sigdelset(&mask, SIGBUS);
+        sigdelset(&mask, SIGFPE);
+        sigdelset(&mask, SIGILL);
+        pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+        for (int i = 0; i < n; i++)
+            spawned[i] = !pthread_create(&tid[i], NULL, doit, &workers[i]);
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+        for (int i = 0; i < n; i++) {
+            if (spawned[i]) {
+                pthread_join(tid[i], NULL);
+            } else {
+                /* never move the thread running commands to another CPU */
+                workers[i].cpu = -1;
+                doit(&workers[i]);
+            }
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (workers[i].failed)
+            die();
+        for (size_t j = 0; j < n_tests; j++)
+            t_merge(&t[j], &workers[i].t[j]);
+    }
+}
+
+/* Measure a single batch right here, only to set the percentiles from */
+static void calibrate(int mode)
+{
+    static worker_t w;
+
+    w.mode = mode;
+    w.cpu = -1;
+    w.batches = 1;
+    w.calibrate = true;
+    doit(&w);
+    if (w.failed)
+        die();
 }
 
 static bool TEST_CONST(char *text, int mode)
 {
     bool result = false;
-    t = malloc(sizeof(t_ctx));
+    int batches = enough_measure / (n_measure - drop_size * 2) + 1;
+    t = malloc(n_tests * sizeof(t_ctx));
 
+    /* The workers fill and empty their queues through the harness, keep them
+     * to the fast mode counted without allocated_lock, lest they wait on each
+     * other in the middle of a measurement.
+     */
+    int old_level = harness_level;
+    harness_level = HARNESS_FAST;
+    if (dudect_crop)
+        calibrate(mode);
     for (int cnt = 0; cnt < test_tries; ++cnt) {
         printf("Testing %s...(%d/%d)\n\n", text, cnt, test_tries);
-        init_once();
-        for (int i = 0; i < enough_measure / (n_measure - drop_size * 2) + 1;
-             ++i)
-            result = doit(mode);
+        for (size_t i = 0; i < n_tests; i++)
+            t_init(&t[i]);
+        measure_batches(mode, batches);
+        result = report();
         printf("\033[A\033[2K\033[A\033[2K");
         if (result == true)
             break;
     }
+    harness_level = old_level;
     free(t);
     return result;
 }
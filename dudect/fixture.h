@@ -4,6 +4,12 @@
 #include <stdbool.h>
 #include "constant.h"
 
+/* Number of threads measuring in parallel, 0 for one per isolated CPU */
+extern int dudect_threads;
+
+/* Also run the t-tests on cropped measurements, off by default */
+extern int dudect_crop;
+
 /* Interface to test if function is constant */
 bool is_insert_head_const(void);
 bool is_insert_tail_const(void);
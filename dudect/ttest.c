@@ -28,6 +28,26 @@ void t_push(t_ctx *ctx, double x, uint8_t class)
     ctx->m2[class] = ctx->m2[class] + delta * (x - ctx->mean[class]);
 }
 
+/* Combine the statistics of src into dst, as if all of its samples had been
+ * pushed to dst as well.  This is the pairwise update of Chan et al.
+ *
+ * See https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance
+ */
+void t_merge(t_ctx *dst, const t_ctx *src)
+{
+    for (int class = 0; class < 2; class ++) {
+        double n = dst->n[class] + src->n[class];
+        if (n == 0)
+            continue;
+
+        double delta = src->mean[class] - dst->mean[class];
+        dst->mean[class] += delta * src->n[class] / n;
+        dst->m2[class] += src->m2[class] +
+                          delta * delta * dst->n[class] * src->n[class] / n;
+        dst->n[class] = n;
+    }
+}
+
 double t_compute(t_ctx *ctx)
 {
     double var[2] = {0.0, 0.0};
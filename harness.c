@@ -1,12 +1,18 @@
 /* Test support code */
 
+#include <linux/mempolicy.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
+#include "random.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -18,6 +24,12 @@
 /* Value at start of every allocated block */
 #define MAGICHEADER 0xdeadbeef
 
+/* Value at start of every block allocated in fast mode, not kept track of */
+#define MAGICFAST 0xfa57b10c
+
+/* Value at start of every region mapped by test_mmap() */
+#define MAGICMAP 0x5ca1ab1e
+
 /* Value when deallocate block */
 #define MAGICFREE 0xffffffff
 
@@ -29,23 +41,81 @@
 
 /* Data structures used by our code */
 
-/* Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
- */
+/* Header placed in front of every allocated block */
 typedef struct BELE {
-    struct BELE *next, *prev;
     size_t payload_size;
     size_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_ele_t;
 
-static block_ele_t *allocated = NULL;
+/* Represent allocated blocks as an open-addressing hash set keyed on block
+ * address. Linear probing with backward-shift deletion keeps both lookup and
+ * removal O(1) on average, so checking every block on free stays cheap even
+ * with millions of live blocks.
+ */
+static block_ele_t **allocated = NULL;
+static size_t allocated_bits = 0; /* log2 of the table capacity */
 static size_t allocated_count = 0;
 
+/* Smallest table the hash set starts with, expressed as log2 */
+#define MIN_TABLE_BITS 10
+
+/* Serialize access to the hash set, code under test may run threads */
+static pthread_mutex_t allocated_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Nesting of the critical sections of the calling thread, and the exception
+ * a signal raised meanwhile.  Jumping out of malloc() or out of a section
+ * holding allocated_lock would deadlock or corrupt the next allocation, so
+ * the exception waits for the outermost section to be left.
+ */
+static __thread volatile sig_atomic_t critical = 0;
+static char *volatile deferred_message = NULL;
+
+static inline void enter_critical(void)
+{
+    critical++;
+}
+
+static inline void leave_critical(void)
+{
+    if (!--critical && deferred_message) {
+        char *msg = deferred_message;
+        deferred_message = NULL;
+        trigger_exception(msg);
+    }
+}
+
+static inline void lock_blocks(void)
+{
+    enter_critical();
+    pthread_mutex_lock(&allocated_lock);
+}
+
+static inline void unlock_blocks(void)
+{
+    pthread_mutex_unlock(&allocated_lock);
+    leave_critical();
+}
+
+/* Counters of all the blocks, updated atomically rather than under
+ * allocated_lock, so that the blocks of fast mode never take the lock
+ */
+static alloc_stats_t stats;
+
+/* Bytes the harness adds to every block */
+#define BLOCK_OVERHEAD (sizeof(block_ele_t) + sizeof(size_t))
+
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+int harness_level = HARNESS_SAFE;
+
+int hugepage_mode = HUGEPAGE_OFF;
+
+/* Size of the huge pages test_mmap() maps */
+#define HUGE_PAGE_SIZE ((size_t) 2 << 20)
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
 static bool error_occurred = false;
@@ -55,6 +125,7 @@ static int time_limit = 1;
 
 /* Data for managing exceptions */
 static jmp_buf env;
+static pthread_t env_thread; /* thread which is able to jump to env */
 static volatile sig_atomic_t jmp_ready = false;
 static bool time_limited = false;
 
@@ -63,11 +134,138 @@ static bool time_limited = false;
 /* Should this allocation fail? */
 static bool fail_allocation()
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    return fail_probability > 0 &&
+           prng_bounded(100) < (uint64_t) fail_probability;
+}
+
+/* Slot where block b would be placed in an empty table.
+ * Fibonacci hashing on the address; the low bits are always zero due to
+ * malloc alignment, hence the multiplication spreading them upward.
+ */
+static inline size_t block_home(const block_ele_t *b, size_t bits)
+{
+    uint64_t h = (uint64_t) (uintptr_t) b * 0x9E3779B97F4A7C15ULL;
+    return (size_t) (h >> (64 - bits));
+}
+
+/* Double the table capacity and rehash all live blocks */
+static void block_set_grow()
+{
+    size_t bits = allocated_bits ? allocated_bits + 1 : MIN_TABLE_BITS;
+    size_t mask = ((size_t) 1 << bits) - 1;
+    block_ele_t **table = calloc(mask + 1, sizeof(block_ele_t *));
+    if (!table) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        return;
+    }
+
+    if (allocated) {
+        size_t old_cap = (size_t) 1 << allocated_bits;
+        for (size_t i = 0; i < old_cap; i++) {
+            block_ele_t *b = allocated[i];
+            if (!b)
+                continue;
+            size_t j = block_home(b, bits);
+            while (table[j])
+                j = (j + 1) & mask;
+            table[j] = b;
+        }
+        free(allocated);
+    }
+
+    allocated = table;
+    allocated_bits = bits;
+}
+
+#define COUNT_ADD(var, n) __atomic_add_fetch(&(var), (n), __ATOMIC_RELAXED)
+#define COUNT_SUB(var, n) __atomic_sub_fetch(&(var), (n), __ATOMIC_RELAXED)
+#define COUNT_GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+/* Account block b as allocated */
+static void count_block(const block_ele_t *b)
+{
+    COUNT_ADD(allocated_count, 1);
+    COUNT_ADD(stats.mallocs, 1);
+    COUNT_ADD(stats.bytes, b->payload_size);
+    COUNT_ADD(stats.overhead, BLOCK_OVERHEAD);
+
+    size_t live = COUNT_ADD(stats.live, b->payload_size);
+    size_t peak = COUNT_GET(stats.peak);
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&stats.peak, &peak, live, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* Account block b as freed */
+static void uncount_block(const block_ele_t *b)
+{
+    COUNT_SUB(allocated_count, 1);
+    COUNT_ADD(stats.frees, 1);
+    COUNT_SUB(stats.live, b->payload_size);
+    COUNT_SUB(stats.overhead, BLOCK_OVERHEAD);
+}
+
+/* Record block b as allocated */
+static void block_set_insert(block_ele_t *b)
+{
+    /* Keep load factor at most 1/2 so that probe sequences stay short */
+    size_t cap = allocated ? (size_t) 1 << allocated_bits : 0;
+    if ((COUNT_GET(allocated_count) + 1) * 2 > cap)
+        block_set_grow();
+
+    size_t mask = ((size_t) 1 << allocated_bits) - 1;
+    size_t i = block_home(b, allocated_bits);
+    while (allocated[i])
+        i = (i + 1) & mask;
+    allocated[i] = b;
+    count_block(b);
 }
 
-/* Find header of block, given its payload.
+/* Find slot holding block b.
+ * Return the slot index, or SIZE_MAX if b is not allocated.
+ */
+static size_t block_set_find(const block_ele_t *b)
+{
+    if (!allocated)
+        return SIZE_MAX;
+
+    size_t mask = ((size_t) 1 << allocated_bits) - 1;
+    for (size_t i = block_home(b, allocated_bits); allocated[i];
+         i = (i + 1) & mask) {
+        if (allocated[i] == b)
+            return i;
+    }
+    return SIZE_MAX;
+}
+
+/* Remove block at slot i, shifting later members of its probe run backward
+ * so that no tombstone is needed.
+ */
+static void block_set_remove(size_t i)
+{
+    size_t mask = ((size_t) 1 << allocated_bits) - 1;
+    size_t j = i;
+
+    uncount_block(allocated[i]);
+
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!allocated[j])
+            break;
+
+        /* Move allocated[j] into hole i unless its home lies in (i, j] */
+        size_t k = block_home(allocated[j], allocated_bits);
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        allocated[i] = allocated[j];
+        i = j;
+    }
+
+    allocated[i] = NULL;
+}
+
+/* Find header of block, given its payload, and forget the block.
  * Signal error if doesn't seem like legitimate block
  */
 static block_ele_t *find_header(void *p)
@@ -78,20 +276,18 @@ static block_ele_t *find_header(void *p)
     }
 
     block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
-    if (cautious_mode) {
+
+    lock_blocks();
+    size_t slot = block_set_find(b);
+    if (slot != SIZE_MAX)
+        block_set_remove(slot);
+    unlock_blocks();
+
+    if (cautious_mode && slot == SIZE_MAX) {
         /* Make sure this is really an allocated block */
-        block_ele_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
-            report_event(MSG_ERROR,
-                         "Attempted to free unallocated block.  Address = %p",
-                         p);
-            error_occurred = true;
-        }
+        report_event(MSG_ERROR,
+                     "Attempted to free unallocated block.  Address = %p", p);
+        error_occurred = true;
     }
 
     if (b->magic_header != MAGICHEADER) {
@@ -127,6 +323,8 @@ void *test_malloc(size_t size)
         return NULL;
     }
 
+    /* the block is counted before an exception can jump out */
+    enter_critical();
     block_ele_t *new_block =
         malloc(size + sizeof(block_ele_t) + sizeof(size_t));
     if (!new_block) {
@@ -134,22 +332,25 @@ void *test_malloc(size_t size)
         error_occurred = true;
     }
 
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->magic_header = MAGICHEADER;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
-    *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
-    memset(p, FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    if (harness_level == HARNESS_FAST) {
+        new_block->magic_header = MAGICFAST;
+        count_block(new_block);
+        leave_critical();
+        return p;
+    }
+
+    // cppcheck-suppress nullPointerRedundantCheck
+    new_block->magic_header = MAGICHEADER;
+    *find_footer(new_block) = MAGICFOOTER;
+    memset(p, FILLCHAR, size);
+    lock_blocks();
+    block_set_insert(new_block);
+    unlock_blocks();
+    leave_critical();
 
     return p;
 }
@@ -176,7 +377,20 @@ void test_free(void *p)
     if (!p)
         return;
 
-    block_ele_t *b = find_header(p);
+    /* the block is freed before an exception can jump out */
+    enter_critical();
+
+    /* blocks allocated in fast mode stay unchecked whatever the mode now */
+    block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
+    if (b->magic_header == MAGICFAST) {
+        b->magic_header = MAGICFREE;
+        uncount_block(b);
+        free(b);
+        leave_critical();
+        return;
+    }
+
+    b = find_header(p);
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
         report_event(MSG_ERROR,
@@ -189,18 +403,84 @@ void test_free(void *p)
     *find_footer(b) = MAGICFREE;
     memset(p, FILLCHAR, b->payload_size);
 
-    /* Unlink from list */
-    block_ele_t *bn = b->next;
-    block_ele_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
-
     free(b);
-    allocated_count--;
+    leave_critical();
+}
+
+/* Prefer the NUMA node of the calling thread for the pages of a region not
+ * touched yet.  Nothing to do if it fails, the pages land somewhere anyway.
+ */
+static void bind_local(void *p, size_t len)
+{
+    unsigned int cpu, node;
+    unsigned long mask;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) || node >= 8 * sizeof(mask))
+        return;
+    mask = 1UL << node;
+    syscall(SYS_mbind, p, len, MPOL_PREFERRED, &mask, 8 * sizeof(mask) + 1,
+            0);
+}
+
+void *test_mmap(size_t size)
+{
+    if (hugepage_mode == HUGEPAGE_OFF)
+        return NULL;
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to mmap disallowed");
+        return NULL;
+    }
+    if (fail_allocation()) {
+        report_event(MSG_WARN, "Mmap returning NULL");
+        return NULL;
+    }
+
+    size_t len = (size + sizeof(block_ele_t) + HUGE_PAGE_SIZE - 1) &
+                 ~(HUGE_PAGE_SIZE - 1);
+    void *map = MAP_FAILED;
+    if (hugepage_mode == HUGEPAGE_EXPLICIT)
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (map == MAP_FAILED) {
+        /* a region aligned to huge pages can be backed by them all along */
+        char *raw = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED)
+            return NULL;
+        char *start = (char *) (((uintptr_t) raw + HUGE_PAGE_SIZE - 1) &
+                                ~(HUGE_PAGE_SIZE - 1));
+        if (start > raw)
+            munmap(raw, start - raw);
+        munmap(start + len, raw + HUGE_PAGE_SIZE - start);
+        map = start;
+        madvise(map, len, MADV_HUGEPAGE);
+    }
+    bind_local(map, len);
+
+    block_ele_t *b = map;
+    b->payload_size = len - sizeof(block_ele_t);
+    b->magic_header = MAGICMAP;
+    count_block(b);
+    return (void *) &b->payload;
+}
+
+void test_munmap(void *p)
+{
+    if (!p)
+        return;
+
+    block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
+    if (b->magic_header != MAGICMAP) {
+        report_event(MSG_ERROR,
+                     "Attempted to unmap a region not mapped.  Address = %p",
+                     p);
+        error_occurred = true;
+        return;
+    }
+
+    b->magic_header = MAGICFREE;
+    uncount_block(b);
+    munmap(b, b->payload_size + sizeof(block_ele_t));
 }
 
 // cppcheck-suppress unusedFunction
@@ -214,9 +494,45 @@ char *test_strdup(const char *s)
     return memcpy(new, s, len);
 }
 
+/* Check the header and the footer of every block kept track of */
+static void check_blocks()
+{
+    size_t cap = allocated ? (size_t) 1 << allocated_bits : 0;
+    for (size_t i = 0; i < cap; i++) {
+        block_ele_t *b = allocated[i];
+        if (!b)
+            continue;
+        if (b->magic_header != MAGICHEADER ||
+            *find_footer(b) != MAGICFOOTER) {
+            report_event(MSG_ERROR,
+                         "Corruption detected in allocated block with "
+                         "address %p",
+                         (void *) &b->payload);
+            error_occurred = true;
+        }
+    }
+}
+
 size_t allocation_check()
 {
-    return allocated_count;
+    if (harness_level == HARNESS_PARANOID) {
+        lock_blocks();
+        check_blocks();
+        unlock_blocks();
+    }
+    return COUNT_GET(allocated_count);
+}
+
+void alloc_stats(alloc_stats_t *s, bool reset_peak)
+{
+    s->mallocs = COUNT_GET(stats.mallocs);
+    s->frees = COUNT_GET(stats.frees);
+    s->bytes = COUNT_GET(stats.bytes);
+    s->live = COUNT_GET(stats.live);
+    s->peak = COUNT_GET(stats.peak);
+    s->overhead = COUNT_GET(stats.overhead);
+    if (reset_peak)
+        __atomic_store_n(&stats.peak, s->live, __ATOMIC_RELAXED);
 }
 
 /* Implementation of functions for testing */
@@ -264,7 +580,9 @@ bool exception_setup(bool limit_time)
         return false;
     }
 
-    /* Got here from initial call */
+    /* Got here from initial call, an exception deferred before is stale */
+    deferred_message = NULL;
+    env_thread = pthread_self();
     jmp_ready = true;
     if (limit_time) {
         alarm(time_limit);
@@ -282,15 +600,20 @@ void exception_cancel()
     }
 
     jmp_ready = false;
+    deferred_message = NULL;
     error_message = "";
 }
 
 /* Use longjmp to return to most recent exception setup */
 void trigger_exception(char *msg)
 {
+    if (critical) {
+        deferred_message = msg;
+        return;
+    }
     error_occurred = true;
     error_message = msg;
-    if (jmp_ready)
+    if (jmp_ready && pthread_equal(env_thread, pthread_self()))
         siglongjmp(env, 1);
     else
         exit(1);
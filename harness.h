@@ -7,7 +7,8 @@
 
 /* This test harness enables us to do stringent testing of code.
  * It overloads the library versions of malloc and free with ones that
- * allow checking for common allocation errors.
+ * allow checking for common allocation errors. They may be called from
+ * several threads at once.
  */
 
 void *test_malloc(size_t size);
@@ -16,14 +17,62 @@ void test_free(void *p);
 char *test_strdup(const char *s);
 /* FIXME: provide test_realloc as well */
 
+/* An exception raised inside test_malloc() or test_free(), by the time limit
+ * expiring, is deferred until they are done with the block, then they jump
+ * out to the exception setup all the same.  test_malloc() jumps with the
+ * block allocated and counted, so that it shows up as never freed, and
+ * test_free() with the block freed.
+ */
+
+/* Map a region of at least size bytes on huge pages, placed on the NUMA node
+ * of the calling thread, for the big arenas of a queue.  The region counts as
+ * one block, freed with test_munmap().
+ *
+ * Return NULL if huge pages are off, which they are by default, or the
+ * mapping failed.  Callers fall back to malloc then.
+ */
+void *test_mmap(size_t size);
+void test_munmap(void *p);
+
 #ifdef INTERNAL
 
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Counters of the allocations through the harness */
+typedef struct {
+    size_t mallocs;  /* blocks allocated */
+    size_t frees;    /* blocks freed */
+    size_t bytes;    /* bytes allocated */
+    size_t live;     /* bytes allocated and not freed yet */
+    size_t peak;     /* most bytes live at once */
+    size_t overhead; /* bytes of the headers and footers of the live blocks */
+} alloc_stats_t;
+
+/* Read the counters.  All of them count from the start, except peak, which
+ * starts over from the bytes live if reset_peak is true.
+ */
+void alloc_stats(alloc_stats_t *stats, bool reset_peak);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* How thoroughly the blocks are checked, HARNESS_SAFE by default.
+ * HARNESS_FAST only marks every block with a header, checked when it is
+ * freed, and counts the live blocks.  HARNESS_SAFE also keeps track of every
+ * block, fills it when allocated and when freed, and checks its footer.
+ * HARNESS_PARANOID also checks all the live blocks on allocation_check().
+ */
+enum { HARNESS_FAST, HARNESS_SAFE, HARNESS_PARANOID };
+extern int harness_level;
+
+/* Huge pages of test_mmap(): HUGEPAGE_OFF by default.  HUGEPAGE_THP maps
+ * regions aligned to huge pages and advises transparent huge pages on them,
+ * HUGEPAGE_EXPLICIT takes them from the hugetlbfs pool first.
+ */
+enum { HUGEPAGE_OFF, HUGEPAGE_THP, HUGEPAGE_EXPLICIT };
+extern int hugepage_mode;
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -40,7 +89,9 @@ void set_noallocate_mode(bool noallocate);
 bool error_check();
 
 /* Prepare for a risky operation using setjmp.
- * Function returns true for initial return, false for error return
+ * Function returns true for initial return, false for error return.
+ * Only the calling thread can return here through trigger_exception, so
+ * threads started by the risky operation should keep SIGALRM blocked.
  */
 bool exception_setup(bool limit_time);
 
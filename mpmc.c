@@ -0,0 +1,139 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "harness.h"
+#include "mpmc.h"
+
+/* Keep the positions of producers and consumers on cache lines of their own */
+#define CACHE_LINE 64
+
+/*
+ * A slot at index pos & mask is free for the producer at position pos when
+ * its sequence number is pos, and full for the consumer at position pos when
+ * it is pos + 1.  The consumer hands it over to the next lap by setting it to
+ * pos + capacity.
+ */
+struct mpmc_slot {
+    atomic_size_t seq;
+    element_t *e;
+};
+
+struct mpmc {
+    struct mpmc_slot *slots;
+    size_t mask; /* capacity - 1 */
+    char pad0[CACHE_LINE];
+    atomic_size_t tail; /* position of the next push */
+    char pad1[CACHE_LINE - sizeof(atomic_size_t)];
+    atomic_size_t head; /* position of the next pop */
+    char pad2[CACHE_LINE - sizeof(atomic_size_t)];
+};
+
+mpmc_t *mpmc_new(size_t capacity)
+{
+    size_t cap = 1;
+    while (cap < capacity)
+        cap <<= 1;
+
+    mpmc_t *q = malloc(sizeof(mpmc_t));
+    if (!q)
+        return NULL;
+    q->slots = malloc(cap * sizeof(struct mpmc_slot));
+    if (!q->slots) {
+        free(q);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < cap; i++) {
+        atomic_init(&q->slots[i].seq, i);
+        q->slots[i].e = NULL;
+    }
+    q->mask = cap - 1;
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->head, 0);
+    return q;
+}
+
+void mpmc_free(mpmc_t *q)
+{
+    element_t *e;
+
+    if (!q)
+        return;
+    while ((e = mpmc_pop(q)))
+        q_release_element(e);
+    free(q->slots);
+    free(q);
+}
+
+element_t *mpmc_new_element(const char *s)
+{
+    element_t *e = malloc(sizeof(element_t));
+    if (!e)
+        return NULL;
+
+    e->value = strdup(s);
+    if (!e->value) {
+        free(e);
+        return NULL;
+    }
+    e->len = strlen(e->value);
+    e->pool = NULL;
+    return e;
+}
+
+bool mpmc_push(mpmc_t *q, element_t *e)
+{
+    struct mpmc_slot *slot;
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    for (;;) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+        if (dif == 0) {
+            /* on failure, pos is reloaded with the position won by another */
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            /* not popped yet since the previous lap */
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+
+    slot->e = e;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+element_t *mpmc_pop(mpmc_t *q)
+{
+    struct mpmc_slot *slot;
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    for (;;) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            /* not pushed yet in this lap */
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+
+    element_t *e = slot->e;
+    atomic_store_explicit(&slot->seq, pos + q->mask + 1, memory_order_release);
+    return e;
+}
@@ -0,0 +1,73 @@
+#ifndef LAB0_MPMC_H
+#define LAB0_MPMC_H
+
+/* Concurrent queue of strings, for any number of producers and consumers.
+ *
+ * A bounded ring of element_t pointers, after Dmitry Vyukov's bounded MPMC
+ * queue.  Every slot carries a sequence number telling whether it is ready to
+ * be written or read in the current lap around the ring, and producers and
+ * consumers claim slots with a compare-and-swap on their own position.
+ *
+ * The ring only hands whole elements over and never frees memory another
+ * thread may still read, so it needs no hazard pointers or epochs: an
+ * element belongs to whoever removed it, who releases it with
+ * q_release_element().
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "queue.h"
+
+typedef struct mpmc mpmc_t;
+
+/**
+ * mpmc_new() - Create an empty concurrent queue
+ * @capacity: number of elements the queue holds at most, rounded up to a
+ *            power of two
+ *
+ * Return: NULL for allocation failed
+ */
+mpmc_t *mpmc_new(size_t capacity);
+
+/**
+ * mpmc_free() - Free the queue and the elements still in it, no effect if
+ *               queue is NULL
+ * @q: the queue, no other thread may use it anymore
+ */
+void mpmc_free(mpmc_t *q);
+
+/**
+ * mpmc_new_element() - Allocate an element holding a copy of a string
+ * @s: the string
+ *
+ * Safe to call from any thread.  The element is released with
+ * q_release_element().
+ *
+ * Return: NULL for allocation failed
+ */
+element_t *mpmc_new_element(const char *s);
+
+/**
+ * mpmc_push() - Insert an element at the tail of the queue
+ * @q: the queue
+ * @e: the element, handed over to the queue on success
+ *
+ * Lock-free, safe to call from any thread.
+ *
+ * Return: true for success, false if the queue is full
+ */
+bool mpmc_push(mpmc_t *q, element_t *e);
+
+/**
+ * mpmc_pop() - Remove the element at the head of the queue
+ * @q: the queue
+ *
+ * Lock-free, safe to call from any thread.  The elements pushed by one thread
+ * are popped in the order it pushed them.
+ *
+ * Return: the element, handed over to the caller, NULL if the queue is empty
+ */
+element_t *mpmc_pop(mpmc_t *q);
+
+#endif /* LAB0_MPMC_H */
@@ -0,0 +1,454 @@
+/* Multi-threaded tests of the concurrent queues, see mt.h */
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mpmc.h"
+#include "mt.h"
+#include "wsdeque.h"
+
+/* Our program needs to use regular malloc/free */
+#define INTERNAL 1
+#include "harness.h"
+
+#include "queue.h"
+#include "report.h"
+
+/* Elements the ring holds at most */
+#define MT_CAPACITY 1024
+
+/* Room for the strings inserted, "producer:sequence" */
+#define MT_STRLEN 24
+
+typedef struct {
+    const mt_opts_t *opts;
+    mpmc_t *ring;
+    /* the list and its lock, when testing the locked list */
+    struct list_head *list;
+    pthread_mutex_t lock;
+
+    atomic_size_t expected; /* strings to be removed, less failed insertions */
+    atomic_size_t consumed;
+    atomic_bool stop;       /* a thread could not be started */
+    atomic_uchar *seen;     /* whether every string was removed */
+    atomic_size_t failed;   /* insertions failed */
+    atomic_size_t invalid;  /* strings removed that were never inserted */
+    atomic_size_t dups;     /* strings removed more than once */
+    atomic_size_t reorders; /* strings removed before an earlier one */
+} mt_shared_t;
+
+/* A thread, and what it shares with the others */
+typedef struct {
+    void *s;
+    int id;
+} mt_worker_t;
+
+typedef struct {
+    const ws_opts_t *opts;
+    wsdeque_t *deques[MT_MAX_THREADS];
+    /* the list and its lock, when testing the locked list */
+    struct list_head *list;
+    pthread_mutex_t lock;
+
+    atomic_llong pending; /* tasks inserted and not done yet */
+    atomic_size_t done[WS_MAX_DEPTH + 1]; /* tasks done at every depth */
+    atomic_size_t failed;                 /* insertions failed */
+    atomic_size_t invalid;                /* tasks that were never inserted */
+    atomic_size_t steals;
+} ws_shared_t;
+
+/* Keep asynchronous signals, SIGALRM of the harness among them, away from the
+ * threads.  Faults are still delivered at once.
+ */
+static void block_signals(sigset_t *old_mask)
+{
+    sigset_t mask;
+
+    sigfillset(&mask);
+    sigdelset(&mask, SIGSEGV);
+    sigdelset(&mask, SIGBUS);
+    sigdelset(&mask, SIGFPE);
+    sigdelset(&mask, SIGILL);
+    pthread_sigmask(SIG_BLOCK, &mask, old_mask);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool insert(mt_shared_t *s, const char *str)
+{
+    if (s->list) {
+        pthread_mutex_lock(&s->lock);
+        bool ok = q_insert_tail(s->list, (char *) str);
+        pthread_mutex_unlock(&s->lock);
+        return ok;
+    }
+
+    element_t *e = mpmc_new_element(str);
+    if (!e)
+        return false;
+    /* full, wait for the consumers to catch up */
+    while (!mpmc_push(s->ring, e)) {
+        if (atomic_load(&s->stop)) {
+            q_release_element(e);
+            return false;
+        }
+        sched_yield();
+    }
+    return true;
+}
+
+static element_t *remove_head(mt_shared_t *s)
+{
+    if (!s->list)
+        return mpmc_pop(s->ring);
+
+    pthread_mutex_lock(&s->lock);
+    element_t *e = q_remove_head(s->list, NULL, 0);
+    pthread_mutex_unlock(&s->lock);
+    return e;
+}
+
+static void *produce(void *arg)
+{
+    mt_worker_t *w = arg;
+    mt_shared_t *s = w->s;
+    char str[MT_STRLEN];
+
+    for (int i = 0; i < s->opts->ops && !atomic_load(&s->stop); i++) {
+        snprintf(str, sizeof(str), "%d:%d", w->id, i);
+        if (!insert(s, str)) {
+            atomic_fetch_add(&s->failed, 1);
+            atomic_fetch_sub(&s->expected, 1);
+        }
+    }
+    return NULL;
+}
+
+/* Check a string removed, given the last sequence removed of every producer */
+static void check(mt_shared_t *s, const char *str, int *last)
+{
+    char *end;
+    long p = strtol(str, &end, 10), i = -1;
+    if (*end == ':')
+        i = strtol(end + 1, &end, 10);
+    if (*end || p < 0 || p >= s->opts->producers || i < 0 ||
+        i >= s->opts->ops) {
+        atomic_fetch_add(&s->invalid, 1);
+        return;
+    }
+
+    if (atomic_exchange(&s->seen[p * s->opts->ops + i], 1))
+        atomic_fetch_add(&s->dups, 1);
+    if (i <= last[p])
+        atomic_fetch_add(&s->reorders, 1);
+    last[p] = i;
+}
+
+static void *consume(void *arg)
+{
+    mt_worker_t *w = arg;
+    mt_shared_t *s = w->s;
+    int *last = malloc(s->opts->producers * sizeof(int));
+    if (!last) {
+        atomic_store(&s->stop, true);
+        return NULL;
+    }
+    for (int p = 0; p < s->opts->producers; p++)
+        last[p] = -1;
+
+    while (atomic_load(&s->consumed) < atomic_load(&s->expected) &&
+           !atomic_load(&s->stop)) {
+        element_t *e = remove_head(s);
+        if (!e) {
+            sched_yield();
+            continue;
+        }
+        atomic_fetch_add(&s->consumed, 1);
+        check(s, e->value, last);
+        q_release_element(e);
+    }
+
+    free(last);
+    return NULL;
+}
+
+bool mt_run(const mt_opts_t *opts)
+{
+    int threads = opts->producers + opts->consumers;
+    size_t total = (size_t) opts->producers * opts->ops;
+    mt_shared_t s = {.opts = opts};
+    pthread_t tid[2 * MT_MAX_THREADS];
+    mt_worker_t workers[2 * MT_MAX_THREADS];
+    bool spawned[2 * MT_MAX_THREADS];
+    sigset_t old_mask;
+    bool ok = true;
+
+    if (opts->producers < 1 || opts->producers > MT_MAX_THREADS ||
+        opts->consumers < 1 || opts->consumers > MT_MAX_THREADS ||
+        opts->ops < 1) {
+        report(1, "Need 1-%d producers and consumers, and positive ops",
+               MT_MAX_THREADS);
+        return false;
+    }
+
+    /* every string has to make it through */
+    int saved_probability = fail_probability;
+    fail_probability = 0;
+
+    s.seen = calloc(total, sizeof(atomic_uchar));
+    if (opts->locked)
+        s.list = q_new();
+    else
+        s.ring = mpmc_new(MT_CAPACITY);
+    if (!s.seen || (!s.list && !s.ring)) {
+        report(1, "Could not allocate for the test");
+        free(s.seen);
+        q_free(s.list);
+        mpmc_free(s.ring);
+        fail_probability = saved_probability;
+        return false;
+    }
+    pthread_mutex_init(&s.lock, NULL);
+    atomic_init(&s.expected, total);
+
+    block_signals(&old_mask);
+    double start = now();
+    for (int i = 0; i < threads; i++) {
+        bool producer = i < opts->producers;
+        workers[i].s = &s;
+        workers[i].id = producer ? i : i - opts->producers;
+        spawned[i] = !pthread_create(&tid[i], NULL,
+                                     producer ? produce : consume,
+                                     &workers[i]);
+        if (!spawned[i])
+            atomic_store(&s.stop, true);
+    }
+    for (int i = 0; i < threads; i++)
+        if (spawned[i])
+            pthread_join(tid[i], NULL);
+    double seconds = now() - start;
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    size_t lost = 0;
+    for (size_t i = 0; i < total; i++)
+        lost += !s.seen[i];
+    lost -= atomic_load(&s.failed);
+
+    if (atomic_load(&s.stop)) {
+        report(1, "ERROR: Could not start all the threads");
+        ok = false;
+    } else if (atomic_load(&s.failed)) {
+        report(1, "ERROR: %zu insertions failed", atomic_load(&s.failed));
+        ok = false;
+    }
+    if (lost || s.invalid || s.dups || s.reorders) {
+        report(1,
+               "ERROR: %zu strings lost, %zu never inserted, %zu duplicated, "
+               "%zu out of order",
+               lost, atomic_load(&s.invalid), atomic_load(&s.dups),
+               atomic_load(&s.reorders));
+        ok = false;
+    }
+
+    if (ok) {
+        size_t done = atomic_load(&s.consumed);
+        report(1,
+               "mt: %d producers, %d consumers on the %s, %zu strings in "
+               "%.3f s, %.2f M strings/s",
+               opts->producers, opts->consumers,
+               opts->locked ? "locked list" : "ring", done, seconds,
+               seconds > 0 ? done / seconds / 1e6 : 0);
+    }
+
+    q_free(s.list);
+    mpmc_free(s.ring);
+    pthread_mutex_destroy(&s.lock);
+    free(s.seen);
+    fail_probability = saved_probability;
+    return ok;
+}
+
+/* Insert a task of the given depth into the deque of worker id */
+static bool give(ws_shared_t *s, int id, int depth)
+{
+    char str[MT_STRLEN];
+
+    snprintf(str, sizeof(str), "%d", depth);
+    if (s->list) {
+        pthread_mutex_lock(&s->lock);
+        bool ok = q_insert_head(s->list, str);
+        pthread_mutex_unlock(&s->lock);
+        return ok;
+    }
+
+    element_t *e = mpmc_new_element(str);
+    if (!e)
+        return false;
+    if (!ws_push(s->deques[id], e)) {
+        q_release_element(e);
+        return false;
+    }
+    return true;
+}
+
+/* Take a task from the deque of worker id, or else steal one */
+static element_t *take(ws_shared_t *s, int id)
+{
+    if (s->list) {
+        pthread_mutex_lock(&s->lock);
+        element_t *e = q_remove_head(s->list, NULL, 0);
+        pthread_mutex_unlock(&s->lock);
+        return e;
+    }
+
+    element_t *e = ws_pop(s->deques[id]);
+    for (int i = 1; !e && i < s->opts->workers; i++) {
+        e = ws_steal(s->deques[(id + i) % s->opts->workers]);
+        if (e)
+            atomic_fetch_add(&s->steals, 1);
+    }
+    return e;
+}
+
+static void *work(void *arg)
+{
+    mt_worker_t *w = arg;
+    ws_shared_t *s = w->s;
+
+    while (atomic_load(&s->pending) > 0) {
+        element_t *e = take(s, w->id);
+        if (!e) {
+            sched_yield();
+            continue;
+        }
+
+        char *end;
+        long depth = strtol(e->value, &end, 10);
+        bool valid = !*end && depth >= 0 && depth <= s->opts->depth;
+        q_release_element(e);
+        if (!valid) {
+            atomic_fetch_add(&s->invalid, 1);
+            atomic_fetch_sub(&s->pending, 1);
+            continue;
+        }
+
+        /* the children are pending before their parent is done */
+        if (depth > 0) {
+            atomic_fetch_add(&s->pending, 2);
+            for (int c = 0; c < 2; c++) {
+                if (!give(s, w->id, depth - 1)) {
+                    atomic_fetch_add(&s->failed, 1);
+                    atomic_fetch_sub(&s->pending, 1);
+                }
+            }
+        }
+        atomic_fetch_add(&s->done[depth], 1);
+        atomic_fetch_sub(&s->pending, 1);
+    }
+    return NULL;
+}
+
+bool ws_run(const ws_opts_t *opts)
+{
+    ws_shared_t s = {.opts = opts};
+    pthread_t tid[MT_MAX_THREADS];
+    mt_worker_t workers[MT_MAX_THREADS];
+    bool spawned[MT_MAX_THREADS];
+    sigset_t old_mask;
+    bool ok = true, started = true;
+
+    if (opts->workers < 1 || opts->workers > MT_MAX_THREADS ||
+        opts->depth < 0 || opts->depth > WS_MAX_DEPTH) {
+        report(1, "Need 1-%d workers, and a depth of 0-%d", MT_MAX_THREADS,
+               WS_MAX_DEPTH);
+        return false;
+    }
+
+    /* every task has to make it through */
+    int saved_probability = fail_probability;
+    fail_probability = 0;
+
+    bool allocated = true;
+    if (opts->locked) {
+        s.list = q_new();
+        allocated = s.list;
+    } else {
+        for (int i = 0; i < opts->workers; i++)
+            allocated = (s.deques[i] = ws_new()) && allocated;
+    }
+    pthread_mutex_init(&s.lock, NULL);
+    atomic_init(&s.pending, 1);
+    if (!allocated || !give(&s, 0, opts->depth)) {
+        report(1, "Could not allocate for the test");
+        ok = false;
+        goto out;
+    }
+
+    block_signals(&old_mask);
+    double start = now();
+    for (int i = 0; i < opts->workers; i++) {
+        workers[i].s = &s;
+        workers[i].id = i;
+        spawned[i] = !pthread_create(&tid[i], NULL, work, &workers[i]);
+        started = started && spawned[i];
+    }
+    /* the workers started share the tasks of the others */
+    for (int i = 0; i < opts->workers; i++)
+        if (spawned[i])
+            pthread_join(tid[i], NULL);
+    double seconds = now() - start;
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    size_t lost = 0, extra = 0, total = 0;
+    for (int d = 0; d <= opts->depth; d++) {
+        size_t expected = (size_t) 1 << (opts->depth - d);
+        size_t done = atomic_load(&s.done[d]);
+        if (done < expected)
+            lost += expected - done;
+        else
+            extra += done - expected;
+        total += done;
+    }
+
+    if (!started) {
+        report(1, "ERROR: Could not start all the threads");
+        ok = false;
+    }
+    if (atomic_load(&s.failed)) {
+        report(1, "ERROR: %zu insertions failed", atomic_load(&s.failed));
+        ok = false;
+    }
+    if (lost || extra || s.invalid) {
+        report(1,
+               "ERROR: %zu tasks lost, %zu done twice, %zu never inserted",
+               lost, extra, atomic_load(&s.invalid));
+        ok = false;
+    }
+
+    if (ok)
+        report(1,
+               "ws: %d workers on the %s, %zu tasks in %.3f s, %.2f M tasks/s, "
+               "%zu steals",
+               opts->workers, opts->locked ? "locked list" : "deques", total,
+               seconds, seconds > 0 ? total / seconds / 1e6 : 0,
+               atomic_load(&s.steals));
+
+out:
+    q_free(s.list);
+    for (int i = 0; i < opts->workers; i++)
+        ws_free(s.deques[i]);
+    pthread_mutex_destroy(&s.lock);
+    fail_probability = saved_probability;
+    return ok;
+}
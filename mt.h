@@ -0,0 +1,70 @@
+#ifndef LAB0_MT_H
+#define LAB0_MT_H
+
+#include <stdbool.h>
+
+/* Multi-threaded tests of the concurrent queues.
+ *
+ * On the ring of mpmc.h, producers insert numbered strings while consumers
+ * remove them, checking that every string comes out exactly once, and in the
+ * order its producer inserted it.
+ *
+ * On the work-stealing deques of wsdeque.h, workers fan a binary tree of
+ * tasks out, every task inserting its two children into the deque of its
+ * worker, and idle workers stealing from the others.  Every task has to be
+ * done exactly once.
+ */
+
+/* Most producers, and most consumers */
+#define MT_MAX_THREADS 64
+
+/**
+ * mt_opts_t - What to test
+ * @producers: number of producing threads
+ * @consumers: number of consuming threads
+ * @ops: number of strings inserted by every producer
+ * @locked: test the list of queue.h behind a mutex instead, for comparison
+ */
+typedef struct {
+    int producers;
+    int consumers;
+    int ops;
+    bool locked;
+} mt_opts_t;
+
+/**
+ * mt_run() - Run producers and consumers on a queue of their own, check and
+ *            report the results and the throughput
+ * @opts: what to test
+ *
+ * Return: true for success, false for bad arguments, allocation failed, or
+ * strings lost, duplicated or reordered
+ */
+bool mt_run(const mt_opts_t *opts);
+
+/* Deepest tree of tasks */
+#define WS_MAX_DEPTH 24
+
+/**
+ * ws_opts_t - What to run on the work-stealing deques
+ * @workers: number of worker threads
+ * @depth: depth of the tree of tasks, which has 2^(@depth + 1) - 1 tasks
+ * @locked: share the list of queue.h behind a mutex instead, for comparison
+ */
+typedef struct {
+    int workers;
+    int depth;
+    bool locked;
+} ws_opts_t;
+
+/**
+ * ws_run() - Run the workers on deques of their own, check and report the
+ *            results and the throughput
+ * @opts: what to run
+ *
+ * Return: true for success, false for bad arguments, allocation failed, or
+ * tasks lost or done twice
+ */
+bool ws_run(const ws_opts_t *opts);
+
+#endif /* LAB0_MT_H */
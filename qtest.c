@@ -1,17 +1,20 @@
 /* Implementation of testing code for queue code */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h> /* strcasecmp */
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
-#include <time.h>
 #include <unistd.h>
+#include "dudect/cpucycles.h"
 #include "dudect/fixture.h"
 #include "list.h"
 
@@ -32,8 +35,13 @@
  */
 #include "queue.h"
 
+#include "bench.h"
 #include "console.h"
+#include "cqueue.h"
+#include "mt.h"
+#include "random.h"
 #include "report.h"
+#include "strkern.h"
 
 /* Settable parameters */
 
@@ -41,22 +49,42 @@
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST 30
 static int big_list_size = BIG_LIST;
 
+/* Whether show_queue() checks the whole queue every time, instead of only the
+ * nodes near the ends the last command changed
+ */
+static int fullcheck = 0;
+
+/* Profile of the allocations by the commands: 0 for none, 1 to report them
+ * after every command, 2 to report them for each command name at quit
+ */
+static int profile_mode = 0;
+
+/* Check the whole queue at least once every this many show_queue() */
+#define FULLCHECK_PERIOD 1024
+
+/* Nodes checked from each end changed */
+#define CHECK_WINDOW 8
+
 /* Global variables */
 
 /* List being tested */
 typedef struct {
     struct list_head *l;
+    /* compact queue tested instead of l when non-NULL */
+    cqueue_t *cq;
     /* meta data of list */
     int size;
 } list_head_meta_t;
 
 static list_head_meta_t l_meta;
 
+/* Whether new creates compact queues by default, set by option -c */
+static bool compact_default = false;
+
 /* Number of elements in queue */
 static size_t lcnt = 0;
 
@@ -66,6 +94,15 @@ static int fail_count = 0;
 
 static int string_length = MAXSTRING;
 
+/* Whether ih, it and rhq go through the q_*_n() bulk functions */
+static int bulk_mode = 0;
+
+/* How many strings are handed to the bulk functions at once */
+#define BULK_BATCH 4096
+
+/* Whether rh and rt read the removed string in place instead of a copy */
+static int nocopy_mode = 0;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -73,8 +110,58 @@ static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
 /* extern function */
 extern void q_shuffle(struct list_head *);
 
+/* Ends of the queue changed since show_queue() last checked it, none means
+ * nodes anywhere may have changed, and how many nodes from each end did
+ */
+#define TOUCH_HEAD 1
+#define TOUCH_TAIL 2
+static int touched = 0;
+static size_t head_depth = 0, tail_depth = 0;
+
+/* Whether the queue changed while show_queue() was not checking it */
+static bool unchecked = true;
+
 /* Forward declarations */
 static bool show_queue(int vlevel);
+static bool show_queue_ends(int ends, size_t depth);
+
+/* Forget the ends changed, for the next check to cover the whole queue */
+static inline void untouch()
+{
+    touched = 0;
+    head_depth = tail_depth = 0;
+}
+
+/* Whether there is a queue under test, of either kind */
+static inline bool queue_exists()
+{
+    return l_meta.l || l_meta.cq;
+}
+
+/* Cursor walking the strings of the queue under test from its head */
+typedef struct {
+    struct list_head *node;
+    size_t pos;
+} queue_cursor_t;
+
+static queue_cursor_t queue_begin()
+{
+    queue_cursor_t c = {.node = l_meta.l, .pos = 0};
+    return c;
+}
+
+/* Return the next string, NULL after the tail or if there is no queue */
+static char *queue_next(queue_cursor_t *c)
+{
+    if (l_meta.cq)
+        return cq_at(l_meta.cq, c->pos++);
+    if (!c->node)
+        return NULL;
+
+    c->node = c->node->next;
+    return c->node != l_meta.l ? list_entry(c->node, element_t, list)->value
+                               : NULL;
+}
 
 static bool do_free(int argc, char *argv[])
 {
@@ -84,19 +171,21 @@ static bool do_free(int argc, char *argv[])
     }
 
     bool ok = true;
-    if (!l_meta.l)
+    if (!queue_exists())
         report(3, "Warning: Calling free on null queue");
     error_check();
 
-    if (lcnt > big_list_size)
-        set_cautious_mode(false);
-    if (exception_setup(true))
-        q_free(l_meta.l);
+    if (exception_setup(true)) {
+        if (l_meta.cq)
+            cq_free(l_meta.cq);
+        else
+            q_free(l_meta.l);
+    }
     exception_cancel();
-    set_cautious_mode(true);
 
     l_meta.size = 0;
     l_meta.l = NULL;
+    l_meta.cq = NULL;
     lcnt = 0;
     show_queue(3);
 
@@ -112,20 +201,27 @@ static bool do_free(int argc, char *argv[])
 
 static bool do_new(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    bool pooled = argc == 2 && !strcmp(argv[1], "-p");
+    bool compact = argc == 2 && !strcmp(argv[1], "-c");
+    if (argc != 1 && !pooled && !compact) {
+        report(1, "%s takes no arguments other than -p or -c", argv[0]);
         return false;
     }
+    if (argc == 1)
+        compact = compact_default;
 
     bool ok = true;
-    if (l_meta.l) {
+    if (queue_exists()) {
         report(3, "Freeing old queue");
-        ok = do_free(argc, argv);
+        ok = do_free(1, argv);
     }
     error_check();
 
     if (exception_setup(true)) {
-        l_meta.l = q_new();
+        if (compact)
+            l_meta.cq = cq_new();
+        else
+            l_meta.l = pooled ? q_new_pooled() : q_new();
         l_meta.size = 0;
     }
     exception_cancel();
@@ -140,15 +236,98 @@ static bool do_new(int argc, char *argv[])
  */
 static void fill_rand_string(char *buf, size_t buf_size)
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
+    size_t len = MIN_RANDSTR_LEN + prng_bounded(buf_size - MIN_RANDSTR_LEN);
 
-    for (size_t n = 0; n < len; n++)
-        buf[n] = charset[rand() % (sizeof charset - 1)];
+    prng_chars(buf, len, charset, sizeof charset - 1);
     buf[len] = '\0';
 }
 
+/*
+ * Insert the n strings of sv with q_insert_head_n() or q_insert_tail_n(), and
+ * check that they were copied.
+ */
+static bool insert_batch(bool at_head, char **sv, int n)
+{
+    bool ok = true;
+    bool rval = at_head ? q_insert_head_n(l_meta.l, sv, n)
+                        : q_insert_tail_n(l_meta.l, sv, n);
+
+    if (rval) {
+        lcnt += n;
+        l_meta.size += n;
+        /* the last string inserted is next to head or tail */
+        struct list_head *cur = at_head ? l_meta.l->next : l_meta.l->prev;
+        struct list_head *prev = at_head ? cur->next : cur->prev;
+        char *cur_inserts = list_entry(cur, element_t, list)->value;
+        if (!cur_inserts) {
+            report(1, "ERROR: Failed to save copy of string in queue");
+            ok = false;
+        } else if (cur_inserts == sv[n - 1]) {
+            report(1,
+                   "ERROR: Need to allocate and copy string for new queue "
+                   "element");
+            ok = false;
+        } else if (n > 1 &&
+                   list_entry(prev, element_t, list)->value == cur_inserts) {
+            report(1,
+                   "ERROR: Need to allocate separate string for each queue "
+                   "element");
+            ok = false;
+        }
+    } else {
+        fail_count++;
+        if (fail_count < fail_limit)
+            report(2, "Insertion of %d strings failed", n);
+        else {
+            report(1,
+                   "ERROR: Insertion of %d strings failed (%d failures total)",
+                   n, fail_count);
+            ok = false;
+        }
+    }
+
+    return ok && !error_check();
+}
+
+/*
+ * Insert reps copies of inserts, or random strings if need_rand, with
+ * q_insert_head_n() or q_insert_tail_n() in batches of BULK_BATCH strings.
+ */
+static bool insert_bulk(bool at_head, char *inserts, bool need_rand, int reps)
+{
+    char **sv = malloc(BULK_BATCH * sizeof(char *));
+    char *randstrs = need_rand ? malloc(BULK_BATCH * MAX_RANDSTR_LEN) : NULL;
+    bool ok = true;
+
+    if (!sv || (need_rand && !randstrs)) {
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for bulk insertion");
+        free(sv);
+        free(randstrs);
+        return false;
+    }
+
+    if (exception_setup(true)) {
+        for (int done = 0; ok && done < reps;) {
+            int n = reps - done < BULK_BATCH ? reps - done : BULK_BATCH;
+            for (int i = 0; i < n; i++) {
+                sv[i] = inserts;
+                if (need_rand) {
+                    sv[i] = randstrs + i * MAX_RANDSTR_LEN;
+                    fill_rand_string(sv[i], MAX_RANDSTR_LEN);
+                }
+            }
+            done += n;
+            ok = insert_batch(at_head, sv, n);
+        }
+    }
+    exception_cancel();
+
+    free(sv);
+    free(randstrs);
+    return ok;
+}
+
 /* insert head */
 static bool do_ih(int argc, char *argv[])
 {
@@ -166,7 +345,7 @@ static bool do_ih(int argc, char *argv[])
         return ok;
     }
 
-    char *lasts = NULL;
+    const char *lasts = NULL;
     char randstr_buf[MAX_RANDSTR_LEN];
     int reps = 1;
     bool ok = true, need_rand = false;
@@ -188,20 +367,29 @@ static bool do_ih(int argc, char *argv[])
         inserts = randstr_buf;
     }
 
-    if (!l_meta.l)
+    if (!queue_exists())
         report(3, "Warning: Calling insert head on null queue");
     error_check();
 
+    if (bulk_mode && !l_meta.cq) {
+        ok = insert_bulk(true, inserts, need_rand, reps);
+        show_queue_ends(TOUCH_HEAD, reps);
+        return ok;
+    }
+
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
-            bool rval = q_insert_head(l_meta.l, inserts);
+            bool rval = l_meta.cq ? cq_insert_head(l_meta.cq, inserts)
+                                  : q_insert_head(l_meta.l, inserts);
             if (rval) {
                 lcnt++;
                 l_meta.size++;
                 char *cur_inserts =
-                    list_entry(l_meta.l->next, element_t, list)->value;
+                    l_meta.cq
+                        ? cq_at(l_meta.cq, 0)
+                        : list_entry(l_meta.l->next, element_t, list)->value;
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
                     ok = false;
@@ -235,7 +423,7 @@ static bool do_ih(int argc, char *argv[])
     }
     exception_cancel();
 
-    show_queue(3);
+    show_queue_ends(TOUCH_HEAD, reps);
     return ok;
 }
 
@@ -277,20 +465,29 @@ static bool do_it(int argc, char *argv[])
         inserts = randstr_buf;
     }
 
-    if (!l_meta.l)
+    if (!queue_exists())
         report(3, "Warning: Calling insert tail on null queue");
     error_check();
 
+    if (bulk_mode && !l_meta.cq) {
+        ok = insert_bulk(false, inserts, need_rand, reps);
+        show_queue_ends(TOUCH_TAIL, reps);
+        return ok;
+    }
+
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
-            bool rval = q_insert_tail(l_meta.l, inserts);
+            bool rval = l_meta.cq ? cq_insert_tail(l_meta.cq, inserts)
+                                  : q_insert_tail(l_meta.l, inserts);
             if (rval) {
                 lcnt++;
                 l_meta.size++;
                 char *cur_inserts =
-                    list_entry(l_meta.l->prev, element_t, list)->value;
+                    l_meta.cq
+                        ? cq_at(l_meta.cq, cq_size(l_meta.cq) - 1)
+                        : list_entry(l_meta.l->prev, element_t, list)->value;
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
                     ok = false;
@@ -310,10 +507,62 @@ static bool do_it(int argc, char *argv[])
         }
     }
     exception_cancel();
-    show_queue(3);
+    show_queue_ends(TOUCH_TAIL, reps);
     return ok;
 }
 
+/*
+ * Remove an element with q_pop_head_view() or q_pop_tail_view(), and check
+ * and report its string in place, without any buffer to copy it into.
+ */
+static bool remove_view(int option, int argc, char *argv[])
+{
+    element_t *re = NULL;
+    size_t len = 0;
+    bool ok = true;
+
+    if (!l_meta.size)
+        report(3, "Warning: Calling remove head on empty queue");
+    error_check();
+
+    if (exception_setup(true))
+        re = option ? q_pop_tail_view(l_meta.l, &len)
+                    : q_pop_head_view(l_meta.l, &len);
+    exception_cancel();
+
+    if (re) {
+        if (!re->value || re->value[len] != '\0') {
+            report(1, "ERROR: Length of removed string is wrong");
+            ok = false;
+        } else {
+            report(2, "Removed %.*s from queue", string_length, re->value);
+        }
+
+        if (ok && argc > 1 && strncmp(re->value, argv[1], string_length)) {
+            report(1, "ERROR: Removed value %.*s != expected value %.*s",
+                   string_length, re->value, string_length, argv[1]);
+            ok = false;
+        }
+
+        // the element is handed out to us, release it when done
+        q_release_element(re);
+        lcnt--;
+        l_meta.size--;
+    } else {
+        fail_count++;
+        if (argc == 1 && fail_count < fail_limit) {
+            report(2, "Removal from queue failed");
+        } else {
+            report(1, "ERROR: Removal from queue failed (%d failures total)",
+                   fail_count);
+            ok = false;
+        }
+    }
+
+    show_queue_ends(option ? TOUCH_TAIL : TOUCH_HEAD, 1);
+    return ok && !error_check();
+}
+
 static bool do_remove(int option, int argc, char *argv[])
 {
     // option 0 is for remove head; option 1 is for remove tail
@@ -343,6 +592,9 @@ static bool do_remove(int option, int argc, char *argv[])
         return false;
     }
 
+    if (nocopy_mode && !l_meta.cq)
+        return remove_view(option, argc, argv);
+
     char *removes = malloc(string_length + STRINGPAD + 1);
     if (!removes) {
         report(1,
@@ -374,17 +626,26 @@ static bool do_remove(int option, int argc, char *argv[])
     error_check();
 
     element_t *re = NULL;
-    if (exception_setup(true))
-        re = option ? q_remove_tail(l_meta.l, removes, string_length + 1)
-                    : q_remove_head(l_meta.l, removes, string_length + 1);
+    bool is_null = true;
+    if (exception_setup(true)) {
+        if (l_meta.cq) {
+            is_null = !(option ? cq_remove_tail(l_meta.cq, removes,
+                                                string_length + 1)
+                               : cq_remove_head(l_meta.cq, removes,
+                                                string_length + 1));
+        } else {
+            re = option ? q_remove_tail(l_meta.l, removes, string_length + 1)
+                        : q_remove_head(l_meta.l, removes, string_length + 1);
+            is_null = !re;
+        }
+    }
     exception_cancel();
 
-    bool is_null = re ? false : true;
-
     if (!is_null) {
         // q_remove_head and q_remove_tail are not responsible for releasing
         // node
-        q_release_element(re);
+        if (re)
+            q_release_element(re);
 
         removes[string_length + STRINGPAD] = '\0';
         if (removes[0] == '\0') {
@@ -425,7 +686,7 @@ static bool do_remove(int option, int argc, char *argv[])
         ok = false;
     }
 
-    show_queue(3);
+    show_queue_ends(option ? TOUCH_TAIL : TOUCH_HEAD, 1);
 
     free(removes);
     free(checks);
@@ -442,133 +703,264 @@ static inline bool do_rt(int argc, char *argv[])
     return do_remove(1, argc, argv);
 }
 
+/* Remove reps elements from head of queue at once with q_remove_head_n() */
+static bool remove_bulk(int reps)
+{
+    LIST_HEAD(removed);
+    element_t *item, *tmp;
+    int cnt = 0, released = 0;
+    bool ok = true;
+
+    if (exception_setup(true))
+        cnt = q_remove_head_n(l_meta.l, &removed, reps);
+    exception_cancel();
+
+    // q_remove_head_n is not responsible for releasing nodes
+    list_for_each_entry_safe (item, tmp, &removed, list) {
+        q_release_element(item);
+        released++;
+    }
+    lcnt -= released;
+    l_meta.size -= released;
+
+    if (released != cnt) {
+        report(1, "ERROR: Removed %d elements, but %d are handed out", cnt,
+               released);
+        ok = false;
+    } else if (cnt == reps) {
+        report(2, "Removed %d elements from queue", cnt);
+    } else {
+        fail_count++;
+        if (fail_count < fail_limit)
+            report(2, "Removal failed after %d elements", cnt);
+        else {
+            report(1,
+                   "ERROR: Removal failed after %d elements (%d failures "
+                   "total)",
+                   cnt, fail_count);
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
 /* remove head quietly */
 static bool do_rhq(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    int reps = 1;
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
     }
 
+    if (argc == 2) {
+        if (!get_int(argv[1], &reps)) {
+            report(1, "Invalid number of removals '%s'", argv[1]);
+            return false;
+        }
+    }
+
     bool ok = true;
     if (!l_meta.size)
         report(3, "Warning: Calling remove head on empty queue");
     error_check();
 
-    element_t *re = NULL;
+    if (bulk_mode && !l_meta.cq) {
+        ok = remove_bulk(reps);
+        show_queue_ends(TOUCH_HEAD, reps);
+        return ok && !error_check();
+    }
 
-    if (exception_setup(true))
-        re = q_remove_head(l_meta.l, NULL, 0);
-    exception_cancel();
+    for (int r = 0; ok && r < reps; r++) {
+        element_t *re = NULL;
+        bool removed = false;
 
-    if (re) {
-        // q_remove_head and q_remove_tail are not responsible for releasing
-        // node
-        q_release_element(re);
+        if (exception_setup(true)) {
+            if (l_meta.cq) {
+                removed = cq_remove_head(l_meta.cq, NULL, 0);
+            } else {
+                re = q_remove_head(l_meta.l, NULL, 0);
+                removed = re;
+            }
+        }
+        exception_cancel();
 
-        report(2, "Removed element from queue");
-        lcnt--;
-        l_meta.size--;
-    } else {
-        fail_count++;
-        if (fail_count < fail_limit)
-            report(2, "Removal failed");
-        else {
-            report(1, "ERROR: Removal failed (%d failures total)", fail_count);
-            ok = false;
+        if (removed) {
+            // q_remove_head and q_remove_tail are not responsible for
+            // releasing node
+            if (re)
+                q_release_element(re);
+
+            report(2, "Removed element from queue");
+            lcnt--;
+            l_meta.size--;
+        } else {
+            fail_count++;
+            if (fail_count < fail_limit)
+                report(2, "Removal failed");
+            else {
+                report(1, "ERROR: Removal failed (%d failures total)",
+                       fail_count);
+                ok = false;
+            }
         }
+        ok = ok && !error_check();
     }
 
-    show_queue(3);
+    show_queue_ends(TOUCH_HEAD, reps);
     return ok && !error_check();
 }
 
-static bool do_dedup(int argc, char *argv[])
+/* 64-bit FNV-1a fingerprint of a string, used to verify dedup results */
+static uint64_t fingerprint(const char *s)
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (; *s; s++)
+        h = (h ^ (unsigned char) *s) * 0x100000001b3ULL;
+    return h;
+}
+
+/*
+ * Decide which of the n strings survive q_delete_dup_unsorted(), those that
+ * appear exactly once.  fp[] holds the fingerprints of strs[].
+ *
+ * Return false if failed to allocate the table.
+ */
+static bool mark_unique(char **strs, const uint64_t *fp, bool *keep, size_t n)
+{
+    size_t nslots = 2, mask;
+
+    while (nslots < 2 * n)
+        nslots <<= 1;
+    mask = nslots - 1;
+
+    /* slot holds index + 1 of the first string of its kind, 0 if unused */
+    size_t *table = calloc(nslots, sizeof(size_t));
+    size_t *first = malloc(n * sizeof(size_t));
+    if (!table || !first) {
+        free(table);
+        free(first);
         return false;
     }
 
-    LIST_HEAD(l_copy);
-    element_t *item = NULL, *tmp = NULL;
+    for (size_t i = 0; i < n; i++) {
+        size_t s = fp[i] & mask;
+        while (table[s] && (fp[table[s] - 1] != fp[i] ||
+                            strcmp(strs[table[s] - 1], strs[i])))
+            s = (s + 1) & mask;
+        if (!table[s])
+            table[s] = i + 1;
+        first[i] = table[s] - 1;
+        keep[i] = true;
+        if (first[i] != i)
+            keep[first[i]] = false;
+    }
+    for (size_t i = 0; i < n; i++)
+        keep[i] = keep[first[i]];
 
-    // Copy l_meta.l to l_copy
-    if (l_meta.l && !list_empty(l_meta.l)) {
-        list_for_each_entry (item, l_meta.l, list) {
-            size_t slen;
-            tmp = malloc(sizeof(element_t));
-            if (!tmp)
-                break;
-            INIT_LIST_HEAD(&tmp->list);
-            slen = strlen(item->value) + 1;
-            tmp->value = malloc(slen);
-            if (!tmp->value) {
-                free(tmp);
-                break;
-            }
-            memcpy(tmp->value, item->value, slen);
-            list_add_tail(&tmp->list, &l_copy);
-        }
-        // Return false if the loop does not leave properly
-        if (&item->list != l_meta.l) {
-            list_for_each_entry_safe (item, tmp, &l_copy, list) {
-                free(item->value);
-                free(item);
+    free(table);
+    free(first);
+    return true;
+}
+
+static bool do_dedup(int argc, char *argv[])
+{
+    bool unsorted = argc == 2 && !strcmp(argv[1], "-u");
+    if (argc != 1 && !unsorted) {
+        report(1, "%s takes no arguments other than -u", argv[0]);
+        return false;
+    }
+
+    /* Remember the fingerprint of every string and whether it should stay,
+     * instead of copying the whole queue.
+     */
+    size_t n = queue_exists() ? l_meta.size : 0, i = 0;
+    uint64_t *fp = malloc(n * sizeof(uint64_t) + 1);
+    bool *keep = malloc(n * sizeof(bool) + 1);
+    char **strs = unsorted ? malloc(n * sizeof(char *) + 1) : NULL;
+    const char *prev = NULL;
+    char *value;
+    queue_cursor_t c = queue_begin();
+    bool ok = fp && keep && (!unsorted || strs);
+
+    if (ok && n) {
+        while (i < n && (value = queue_next(&c))) {
+            fp[i] = fingerprint(value);
+            if (unsorted) {
+                strs[i] = value;
+            } else {
+                /* a sorted run of equal strings disappears entirely */
+                keep[i] = true;
+                if (i && !strcmp(prev, value))
+                    keep[i] = keep[i - 1] = false;
+                prev = value;
             }
-            report(1,
-                   "INTERNAL ERROR.  Could not allocate space for "
-                   "duplicate checking");
-            return false;
+            i++;
         }
+        n = i;
+        if (unsorted)
+            ok = mark_unique(strs, fp, keep, n);
+    }
+    free(strs);
+    if (!ok) {
+        free(fp);
+        free(keep);
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for duplicate "
+               "checking");
+        return false;
     }
 
-    bool ok = true;
-    if (exception_setup(true))
-        ok = q_delete_dup(l_meta.l);
+    if (exception_setup(true)) {
+        if (l_meta.cq)
+            ok = unsorted ? cq_delete_dup_unsorted(l_meta.cq)
+                          : cq_delete_dup(l_meta.cq);
+        else
+            ok = unsorted ? q_delete_dup_unsorted(l_meta.l)
+                          : q_delete_dup(l_meta.l);
+    }
     exception_cancel();
 
     if (!ok) {
-        list_for_each_entry_safe (item, tmp, &l_copy, list) {
-            free(item->value);
-            free(item);
+        free(fp);
+        free(keep);
+        if (!queue_exists()) {
+            report(1, "ERROR: Calling delete duplicate on null queue");
+            return false;
         }
-        report(1, "ERROR: Calling delete duplicate on null queue");
+        /* some duplicates may be gone already, count what is left */
+        report(1, "ERROR: Could not delete duplicates");
+        l_meta.size = 0;
+        for (c = queue_begin(); queue_next(&c);)
+            l_meta.size++;
+        lcnt = l_meta.size;
+        show_queue(3);
         return false;
     }
 
-    struct list_head *l_tmp = l_meta.l->next;
-    bool is_this_dup = false;
-    // Compare between new list and old one
-    list_for_each_entry (item, &l_copy, list) {
-        // Skip comparison with new list if the string is duplicate
-        bool is_next_dup =
-            item->list.next != &l_copy &&
-            strcmp(list_entry(item->list.next, element_t, list)->value,
-                   item->value) == 0;
-        if (is_this_dup || is_next_dup) {
-            // Update list size
+    /* The survivors must be exactly the marked strings, in original order */
+    c = queue_begin();
+    value = queue_next(&c);
+    for (i = 0; i < n; i++) {
+        if (!keep[i]) {
             lcnt--;
             l_meta.size--;
-        } else if (l_tmp != l_meta.l &&
-                   strcmp(list_entry(l_tmp, element_t, list)->value,
-                          item->value) == 0)
-            l_tmp = l_tmp->next;
+        } else if (value && fingerprint(value) == fp[i])
+            value = queue_next(&c);
         else
             ok = false;
-        is_this_dup = is_next_dup;
     }
     // All elements in new list should be traversed
-    ok = ok && l_tmp == l_meta.l;
+    ok = ok && !value;
     if (!ok)
         report(1,
                "ERROR: Duplicate strings are in queue or distinct strings are "
                "not in queue");
 
-    list_for_each_entry_safe (item, tmp, &l_copy, list) {
-        free(item->value);
-        free(item);
-    }
+    free(fp);
+    free(keep);
 
     show_queue(3);
     return ok && !error_check();
@@ -581,13 +973,17 @@ static bool do_reverse(int argc, char *argv[])
         return false;
     }
 
-    if (!l_meta.l)
+    if (!queue_exists())
         report(3, "Warning: Calling reverse on null queue");
     error_check();
 
     set_noallocate_mode(true);
-    if (exception_setup(true))
-        q_reverse(l_meta.l);
+    if (exception_setup(true)) {
+        if (l_meta.cq)
+            cq_reverse(l_meta.cq);
+        else
+            q_reverse(l_meta.l);
+    }
     exception_cancel();
 
     set_noallocate_mode(false);
@@ -616,26 +1012,32 @@ static bool do_size(int argc, char *argv[])
     }
 
     int cnt = 0;
-    if (!l_meta.l)
+    if (!queue_exists())
         report(3, "Warning: Calling size on null queue");
     error_check();
 
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
-            cnt = q_size(l_meta.l);
+            cnt = l_meta.cq ? cq_size(l_meta.cq) : q_size(l_meta.l);
             ok = ok && !error_check();
         }
     }
     exception_cancel();
 
     if (ok) {
-        if (lcnt == cnt) {
-            report(2, "Queue size = %d", cnt);
-        } else {
+        if (lcnt != cnt) {
             report(1,
                    "ERROR: Computed queue size as %d, but correct value is %d",
                    cnt, (int) lcnt);
             ok = false;
+        } else if (l_meta.size != cnt) {
+            report(1,
+                   "ERROR: Computed queue size as %d, but %d elements are "
+                   "recorded",
+                   cnt, l_meta.size);
+            ok = false;
+        } else {
+            report(2, "Queue size = %d", cnt);
         }
     }
 
@@ -651,35 +1053,47 @@ bool do_sort(int argc, char *argv[])
         return false;
     }
 
-    if (!l_meta.l)
+    if (!queue_exists())
         report(3, "Warning: Calling sort on null queue");
     error_check();
 
-    int cnt = q_size(l_meta.l);
+    int cnt = l_meta.cq ? cq_size(l_meta.cq) : q_size(l_meta.l);
     if (cnt < 2)
         report(3, "Warning: Calling sort on single node");
     error_check();
 
-    set_noallocate_mode(true);
-    if (exception_setup(true))
-        q_sort(l_meta.l);
-    exception_cancel();
-    set_noallocate_mode(false);
-
     bool ok = true;
-    if (l_meta.size) {
-        for (struct list_head *cur_l = l_meta.l->next;
-             cur_l != l_meta.l && --cnt; cur_l = cur_l->next) {
+    if (l_meta.cq) {
+        /* compact queues sort in scratch memory, which must not leak */
+        size_t bcnt = allocation_check();
+        if (exception_setup(true))
+            cq_sort(l_meta.cq);
+        exception_cancel();
+
+        if (allocation_check() != bcnt) {
+            report(1, "ERROR: Sort changed the number of allocated blocks");
+            ok = false;
+        }
+    } else {
+        set_noallocate_mode(true);
+        if (exception_setup(true))
+            q_sort(l_meta.l);
+        exception_cancel();
+        set_noallocate_mode(false);
+    }
+
+    if (ok && l_meta.size) {
+        queue_cursor_t c = queue_begin();
+        char *value = queue_next(&c), *next_value;
+        while (--cnt > 0 && (next_value = queue_next(&c))) {
             /* Ensure each element in ascending order */
             /* FIXME: add an option to specify sorting order */
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
-            if (strcasecmp(item->value, next_item->value) > 0) {
+            if (strcasecmp(value, next_value) > 0) {
                 report(1, "ERROR: Not sorted in ascending order");
                 ok = false;
                 break;
             }
+            value = next_value;
         }
     }
 
@@ -694,16 +1108,19 @@ static bool do_dm(int argc, char *argv[])
         return false;
     }
 
-    if (!l_meta.l)
+    if (!queue_exists())
         report(3, "Warning: Try to access null queue");
     error_check();
 
     bool ok = true;
     if (exception_setup(true))
-        ok = q_delete_mid(l_meta.l);
+        ok = l_meta.cq ? cq_delete_mid(l_meta.cq) : q_delete_mid(l_meta.l);
     exception_cancel();
 
-    lcnt--;
+    if (ok) {
+        lcnt--;
+        l_meta.size--;
+    }
     show_queue(3);
     return ok && !error_check();
 }
@@ -715,13 +1132,17 @@ static bool do_swap(int argc, char *argv[])
         return false;
     }
 
-    if (!l_meta.l)
+    if (!queue_exists())
         report(3, "Warning: Try to access null queue");
     error_check();
 
     set_noallocate_mode(true);
-    if (exception_setup(true))
-        q_swap(l_meta.l);
+    if (exception_setup(true)) {
+        if (l_meta.cq)
+            cq_swap(l_meta.cq);
+        else
+            q_swap(l_meta.l);
+    }
     exception_cancel();
 
     set_noallocate_mode(false);
@@ -732,72 +1153,471 @@ static bool do_swap(int argc, char *argv[])
 
 static bool do_shuffle(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
     }
 
-    if (!l_meta.l)
+    if (argc == 2) {
+        int seed;
+        if (!get_int(argv[1], &seed)) {
+            report(1, "Invalid seed '%s'", argv[1]);
+            return false;
+        }
+        prng_seed(seed);
+    }
+
+    if (!queue_exists())
         report(3, "Warning: Try to access null queue");
     error_check();
 
-    set_noallocate_mode(true);
-    if (exception_setup(true))
-        q_shuffle(l_meta.l);
+    /* Shuffling may use scratch memory, but no block may be left behind */
+    bool ok = true;
+    size_t bcnt = allocation_check();
+    if (exception_setup(true)) {
+        if (l_meta.cq)
+            cq_shuffle(l_meta.cq);
+        else
+            q_shuffle(l_meta.l);
+    }
     exception_cancel();
-    set_noallocate_mode(false);
+
+    if (allocation_check() != bcnt) {
+        report(1, "ERROR: Shuffle changed the number of allocated blocks");
+        ok = false;
+    }
 
     show_queue(3);
+    return ok && !error_check();
+}
+
+/* Snapshot files of save and load: a magic and the number of strings, then
+ * every string as its 32-bit length, its bytes and its terminator, numbers
+ * in the byte order of the machine.  The strings are terminated in the file
+ * so that load inserts them straight out of the mapping.
+ */
+#define SNAPSHOT_MAGIC "QTS1"
+#define SNAPSHOT_HEADER 8
+
+static bool do_save(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    if (!queue_exists()) {
+        report(1, "ERROR: Calling save on null queue");
+        return false;
+    }
+    error_check();
+
+    FILE *f = fopen(argv[1], "wb");
+    if (!f) {
+        report(1, "ERROR: Could not open snapshot '%s' for writing", argv[1]);
+        return false;
+    }
+
+    /* the number of strings is only known once they are written */
+    uint32_t cnt = 0;
+    bool ok = fwrite(SNAPSHOT_MAGIC, 4, 1, f) == 1 &&
+              fwrite(&cnt, sizeof(cnt), 1, f) == 1;
+    bool walked = false;
+    queue_cursor_t c = queue_begin();
+    char *value;
+
+    if (exception_setup(true)) {
+        while (ok && cnt <= lcnt && (value = queue_next(&c))) {
+            uint32_t len = strlen(value);
+            ok = fwrite(&len, sizeof(len), 1, f) == 1 &&
+                 fwrite(value, 1, len + 1, f) == len + 1;
+            cnt++;
+        }
+        walked = true;
+    }
+    exception_cancel();
+
+    if (walked && cnt > lcnt) {
+        report(1, "ERROR:  Queue has more than %d elements", lcnt);
+        walked = false;
+    }
+    ok = ok && walked && !fseek(f, 4, SEEK_SET) &&
+         fwrite(&cnt, sizeof(cnt), 1, f) == 1;
+    if (fclose(f) || !ok) {
+        report(1, "ERROR: Could not save the queue to '%s'", argv[1]);
+        return false;
+    }
+
+    report(2, "Saved %u strings to %s", cnt, argv[1]);
     return !error_check();
 }
 
+/*
+ * Check that a mapped snapshot holds all the strings it claims to and
+ * nothing else, every one of them terminated right after its length.
+ *
+ * Return the number of strings, -1 if the snapshot is malformed.
+ */
+static long check_snapshot(const char *map, size_t size)
+{
+    uint32_t cnt;
+    size_t pos = SNAPSHOT_HEADER;
+
+    if (size < SNAPSHOT_HEADER || memcmp(map, SNAPSHOT_MAGIC, 4))
+        return -1;
+    memcpy(&cnt, map + 4, sizeof(cnt));
+    if (cnt > INT_MAX)
+        return -1;
+
+    for (uint32_t i = 0; i < cnt; i++) {
+        uint32_t len;
+        if (size - pos < sizeof(len))
+            return -1;
+        memcpy(&len, map + pos, sizeof(len));
+        pos += sizeof(len);
+        if (size - pos <= len || map[pos + len] ||
+            memchr(map + pos, '\0', len))
+            return -1;
+        pos += len + 1;
+    }
+
+    return pos == size ? (long) cnt : -1;
+}
+
+/* Insert the cnt strings of a checked snapshot at the tail of the queue */
+static bool load_strings(const char *map, long cnt)
+{
+    char **sv = malloc(BULK_BATCH * sizeof(char *));
+    const char *p = map + SNAPSHOT_HEADER;
+    bool ok = true;
+
+    if (!sv) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for loading");
+        return false;
+    }
+
+    if (exception_setup(true)) {
+        for (long done = 0; ok && done < cnt;) {
+            int n = cnt - done < BULK_BATCH ? cnt - done : BULK_BATCH;
+            for (int i = 0; i < n; i++) {
+                uint32_t len;
+                memcpy(&len, p, sizeof(len));
+                sv[i] = (char *) p + sizeof(len);
+                p += sizeof(len) + len + 1;
+            }
+            done += n;
+
+            if (!l_meta.cq) {
+                ok = insert_batch(false, sv, n);
+                continue;
+            }
+            for (int i = 0; ok && i < n; i++) {
+                if (!cq_insert_tail(l_meta.cq, sv[i])) {
+                    report(1, "ERROR: Insertion of %s failed", sv[i]);
+                    ok = false;
+                    break;
+                }
+                lcnt++;
+                l_meta.size++;
+            }
+            ok = ok && !error_check();
+        }
+    }
+    exception_cancel();
+
+    free(sv);
+    return ok;
+}
+
+static bool do_load(int argc, char *argv[])
+{
+    char *name = argv[0];
+    bool remove_file = false;
+
+    if (argc > 1 && !strcmp(argv[1], "-r")) {
+        remove_file = true;
+        argc--;
+        argv++;
+    }
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", name);
+        return false;
+    }
+
+    if (!queue_exists()) {
+        report(1, "ERROR: Calling load on null queue");
+        return false;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && remove_file)
+        unlink(argv[1]);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        report(1, "ERROR: Could not open snapshot '%s'", argv[1]);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    if (st.st_size < SNAPSHOT_HEADER) {
+        report(1, "ERROR: Malformed snapshot '%s'", argv[1]);
+        close(fd);
+        return false;
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        report(1, "ERROR: Could not open snapshot '%s'", argv[1]);
+        return false;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    long cnt = check_snapshot(map, st.st_size);
+    bool ok = cnt >= 0;
+    if (!ok)
+        report(1, "ERROR: Malformed snapshot '%s'", argv[1]);
+    else
+        ok = load_strings(map, cnt);
+    munmap(map, st.st_size);
+
+    /* the chains are spliced on after the old tail */
+    show_queue_ends(TOUCH_TAIL, cnt > 0 ? cnt : 0);
+    return ok;
+}
+
+static bool do_bench(int argc, char *argv[])
+{
+    bench_opts_t opts = {
+        .size = -1,
+        .rounds = BENCH_ROUNDS,
+        .len = 8,
+        .compact = compact_default,
+        .scatter = false,
+        .json = false,
+    };
+    char *name = argv[0];
+
+    /* options come before the operation */
+    for (argc--, argv++; argc > 0 && argv[0][0] == '-'; argc--, argv++) {
+        if (!strcmp(argv[0], "-j")) {
+            opts.json = true;
+        } else if (!strcmp(argv[0], "-x")) {
+            opts.scatter = true;
+        } else if (argc > 1 && !strcmp(argv[0], "-s")) {
+            if (!get_int(argv[1], &opts.size) || opts.size < 0) {
+                report(1, "Invalid queue size '%s'", argv[1]);
+                return false;
+            }
+            argc--;
+            argv++;
+        } else if (argc > 1 && !strcmp(argv[0], "-r")) {
+            if (!get_int(argv[1], &opts.rounds) || opts.rounds < 1) {
+                report(1, "Invalid number of rounds '%s'", argv[1]);
+                return false;
+            }
+            argc--;
+            argv++;
+        } else {
+            report(1, "Unknown option '%s' of %s", argv[0], name);
+            return false;
+        }
+    }
+
+    if (argc != 2 && argc != 3) {
+        report(1, "%s takes 2-3 arguments", name);
+        return false;
+    }
+    if (!get_int(argv[1], &opts.n) || opts.n < 1) {
+        report(1, "Invalid number of runs '%s'", argv[1]);
+        return false;
+    }
+    if (argc == 3 && (!get_int(argv[2], &opts.len) || opts.len < 0)) {
+        report(1, "Invalid string length '%s'", argv[2]);
+        return false;
+    }
+
+    /* The benchmark runs on a queue of its own, which it frees afterwards */
+    bool ok = false;
+    size_t bcnt = allocation_check();
+    if (exception_setup(false))
+        ok = bench_run(argv[0], &opts);
+    exception_cancel();
+
+    if (ok && allocation_check() != bcnt) {
+        report(1, "ERROR: Benchmark left allocated blocks behind");
+        ok = false;
+    }
+    return ok && !error_check();
+}
+
+static bool do_mt(int argc, char *argv[])
+{
+    mt_opts_t opts = {.locked = false};
+    char *name = argv[0];
+
+    if (argc > 1 && !strcmp(argv[1], "-l")) {
+        opts.locked = true;
+        argc--;
+        argv++;
+    }
+    if (argc != 4) {
+        report(1, "%s takes 3 arguments", name);
+        return false;
+    }
+    if (!get_int(argv[1], &opts.producers) ||
+        !get_int(argv[2], &opts.consumers) || !get_int(argv[3], &opts.ops)) {
+        report(1, "Invalid number of producers, consumers or ops");
+        return false;
+    }
+
+    /* The test runs on a queue of its own, which it frees afterwards */
+    bool ok = false;
+    size_t bcnt = allocation_check();
+    if (exception_setup(false))
+        ok = mt_run(&opts);
+    exception_cancel();
+
+    if (ok && allocation_check() != bcnt) {
+        report(1, "ERROR: Concurrent test left allocated blocks behind");
+        ok = false;
+    }
+    return ok && !error_check();
+}
+
+static bool do_ws(int argc, char *argv[])
+{
+    ws_opts_t opts = {.locked = false};
+    char *name = argv[0];
+
+    if (argc > 1 && !strcmp(argv[1], "-l")) {
+        opts.locked = true;
+        argc--;
+        argv++;
+    }
+    if (argc != 3) {
+        report(1, "%s takes 2 arguments", name);
+        return false;
+    }
+    if (!get_int(argv[1], &opts.workers) || !get_int(argv[2], &opts.depth)) {
+        report(1, "Invalid number of workers or depth");
+        return false;
+    }
+
+    /* The test runs on deques of its own, which it frees afterwards */
+    bool ok = false;
+    size_t bcnt = allocation_check();
+    if (exception_setup(false))
+        ok = ws_run(&opts);
+    exception_cancel();
+
+    if (ok && allocation_check() != bcnt) {
+        report(1, "ERROR: Work-stealing test left allocated blocks behind");
+        ok = false;
+    }
+    return ok && !error_check();
+}
+
+/* Walk the queue forward, then backward, giving up past lcnt nodes.  Links
+ * going round in a cycle that misses the head would walk on forever.  A
+ * forward walk longer than lcnt is left to the caller, which counts the
+ * elements.
+ */
 static bool is_circular()
 {
+    size_t n = 0;
     struct list_head *cur = l_meta.l->next;
-    while (cur != l_meta.l) {
+    while (cur != l_meta.l && n++ <= lcnt) {
         if (!cur)
             return false;
         cur = cur->next;
     }
+    bool longer = cur != l_meta.l;
 
+    n = 0;
     cur = l_meta.l->prev;
-    while (cur != l_meta.l) {
+    while (cur != l_meta.l && n++ <= lcnt) {
         if (!cur)
             return false;
         cur = cur->prev;
     }
+    return cur == l_meta.l || longer;
+}
+
+/* Check the links of the first depth nodes from the head, forward or
+ * backward, and of CHECK_WINDOW nodes past them
+ */
+static bool is_linked_near(bool forward, size_t depth)
+{
+    struct list_head *cur = l_meta.l;
+    for (size_t i = 0; i <= depth + CHECK_WINDOW; i++) {
+        struct list_head *next = forward ? cur->next : cur->prev;
+        if (!next || (forward ? next->prev : next->next) != cur)
+            return false;
+        cur = next;
+        if (cur == l_meta.l)
+            break;
+    }
     return true;
 }
 
+/* Whether show_queue() is due to check the whole queue, and not only the ends
+ * changed since its last check
+ */
+static bool check_whole()
+{
+    static int checks = 0;
+
+    if (fullcheck || unchecked || !touched || lcnt <= big_list_size ||
+        ++checks >= FULLCHECK_PERIOD) {
+        checks = 0;
+        unchecked = false;
+        return true;
+    }
+    return false;
+}
+
 static bool show_queue(int vlevel)
 {
     bool ok = true;
-    if (verblevel < vlevel)
+    if (verblevel < vlevel) {
+        untouch();
+        unchecked = true;
         return true;
+    }
 
     int cnt = 0;
-    if (!l_meta.l) {
+    if (!queue_exists()) {
         report(vlevel, "l = NULL");
+        untouch();
         return true;
     }
 
-    if (!is_circular()) {
-        report(vlevel, "ERROR:  Queue is not doubly circular");
-        return false;
+    bool whole = check_whole();
+    int ends = touched;
+    size_t hd = head_depth, td = tail_depth;
+    untouch();
+    if (!l_meta.cq) {
+        if (whole ? !is_circular()
+                  : ((ends & TOUCH_HEAD) && !is_linked_near(true, hd)) ||
+                        ((ends & TOUCH_TAIL) && !is_linked_near(false, td))) {
+            report(vlevel, "ERROR:  Queue is not doubly circular");
+            return false;
+        }
     }
 
     report_noreturn(vlevel, "l = [");
 
-    struct list_head *ori = l_meta.l;
-    struct list_head *cur = l_meta.l->next;
+    queue_cursor_t c = queue_begin();
+    char *value = NULL;
+    /* only the whole check counts the elements past the printed ones */
+    size_t limit = whole ? lcnt : big_list_size;
 
     if (exception_setup(true)) {
-        while (ok && ori != cur && cnt < lcnt) {
-            element_t *e = list_entry(cur, element_t, list);
+        while (ok && (value = queue_next(&c)) && cnt < limit) {
             if (cnt < big_list_size)
-                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
+                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", value);
             cnt++;
-            cur = cur->next;
             ok = ok && !error_check();
         }
     }
@@ -808,11 +1628,13 @@ static bool show_queue(int vlevel)
         return false;
     }
 
-    if (cur == ori) {
+    if (!value) {
         if (cnt <= big_list_size)
             report(vlevel, "]");
         else
             report(vlevel, " ... ]");
+    } else if (limit < lcnt) {
+        report(vlevel, " ... ]");
     } else {
         report(vlevel, " ... ]");
         report(vlevel, "ERROR:  Queue has more than %d elements", lcnt);
@@ -822,18 +1644,191 @@ static bool show_queue(int vlevel)
     return ok;
 }
 
+/* Show the queue after a command that changed only the depth nodes nearest
+ * its ends, and the links between them and the rest
+ */
+static bool show_queue_ends(int ends, size_t depth)
+{
+    touched |= ends;
+    if ((ends & TOUCH_HEAD) && depth > head_depth)
+        head_depth = depth;
+    if ((ends & TOUCH_TAIL) && depth > tail_depth)
+        tail_depth = depth;
+    return show_queue(3);
+}
+
 static bool do_show(int argc, char *argv[])
 {
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
     }
+    /* asked for, check everything */
+    untouch();
     return show_queue(0);
 }
 
+/* Allocations of all the runs of a command, for profile 2 */
+#define MAX_PROFILED 64
+typedef struct {
+    char name[32];
+    size_t runs;
+    alloc_stats_t total;
+} cmd_profile_t;
+
+static cmd_profile_t profiles[MAX_PROFILED];
+static int profile_cnt = 0;
+
+/* Counters when the previous command was done */
+static alloc_stats_t last_stats;
+
+static void set_profile(int oldval)
+{
+    if (profile_mode < 0 || profile_mode > 2) {
+        report(1, "ERROR: profile must be 0, 1 or 2");
+        profile_mode = oldval;
+        return;
+    }
+    /* the next command counts from here */
+    alloc_stats(&last_stats, true);
+}
+
+static cmd_profile_t *find_profile(const char *name)
+{
+    for (int i = 0; i < profile_cnt; i++)
+        if (!strcmp(profiles[i].name, name))
+            return &profiles[i];
+    if (profile_cnt == MAX_PROFILED)
+        return NULL;
+
+    cmd_profile_t *p = &profiles[profile_cnt++];
+    strncpy(p->name, name, sizeof(p->name) - 1);
+    return p;
+}
+
+/* Account the allocations since the previous command to this one */
+static bool profile_cmd(int argc, char *argv[])
+{
+    if (!profile_mode)
+        return true;
+
+    alloc_stats_t now;
+    alloc_stats(&now, true);
+    alloc_stats_t d = {
+        .mallocs = now.mallocs - last_stats.mallocs,
+        .frees = now.frees - last_stats.frees,
+        .bytes = now.bytes - last_stats.bytes,
+        .live = now.live,
+        .peak = now.peak,
+        .overhead = now.overhead,
+    };
+    last_stats = now;
+
+    if (profile_mode == 1) {
+        report(1,
+               "Profile %s: %zu mallocs, %zu frees, %zu bytes; live %zu "
+               "bytes, peak %zu, overhead %zu",
+               argv[0], d.mallocs, d.frees, d.bytes, d.live, d.peak,
+               d.overhead);
+        return true;
+    }
+
+    cmd_profile_t *p = find_profile(argv[0]);
+    if (!p)
+        return true;
+    p->runs++;
+    p->total.mallocs += d.mallocs;
+    p->total.frees += d.frees;
+    p->total.bytes += d.bytes;
+    if (d.peak > p->total.peak)
+        p->total.peak = d.peak;
+    if (d.overhead > p->total.overhead)
+        p->total.overhead = d.overhead;
+    return true;
+}
+
+static bool profile_quit(int argc, char *argv[])
+{
+    if (profile_mode != 2)
+        return true;
+
+    /* quit frees the queue */
+    char *quit_argv[] = {"quit"};
+    profile_cmd(1, quit_argv);
+
+    report(1, "%-12s %8s %10s %10s %12s %12s %14s", "Command", "runs",
+           "mallocs", "frees", "bytes", "peak live", "peak overhead");
+    for (int i = 0; i < profile_cnt; i++) {
+        cmd_profile_t *p = &profiles[i];
+        report(1, "%-12s %8zu %10zu %10zu %12zu %12zu %14zu", p->name, p->runs,
+               p->total.mallocs, p->total.frees, p->total.bytes, p->total.peak,
+               p->total.overhead);
+    }
+    return true;
+}
+
+static void set_harness(int oldval)
+{
+    if (harness_level < HARNESS_FAST || harness_level > HARNESS_PARANOID) {
+        report(1, "ERROR: harness must be 0, 1 or 2");
+        harness_level = oldval;
+    }
+}
+
+static void set_hugepage(int oldval)
+{
+    if (hugepage_mode < HUGEPAGE_OFF || hugepage_mode > HUGEPAGE_EXPLICIT) {
+        report(1, "ERROR: hugepage must be 0, 1 or 2");
+        hugepage_mode = oldval;
+    }
+}
+
+/* Batches need some measurements left once the outliers are dropped */
+static void set_measure(int oldval)
+{
+    if (n_measure <= 2 * drop_size) {
+        report(1, "ERROR: measure must be larger than %d", 2 * drop_size);
+        n_measure = oldval;
+    }
+}
+
+/* Switch back to the previous timer if the new one is not available */
+static void set_timer(int oldval)
+{
+    int timer = cpucycles_timer;
+
+    cpucycles_timer = oldval;
+    if (!cpucycles_select(timer))
+        report(1, "ERROR: timer %d is not available", timer);
+}
+
+/* Seed of the random generator, 0 for one read from /dev/urandom */
+static int random_seed = 0;
+
+static void set_seed(int oldval)
+{
+    uint64_t seed = random_seed;
+
+    if (!random_seed)
+        randombytes((uint8_t *) &seed, sizeof(seed));
+    prng_seed(seed);
+}
+
+/* Keep the current string kernels if the new ones are not supported */
+static void set_strkern(int oldval)
+{
+    int backend = strkern;
+
+    strkern = oldval;
+    if (!strkern_select(backend))
+        report(1, "ERROR: strkern %d is not supported", backend);
+}
+
 static void console_init()
 {
-    ADD_COMMAND(new, "                | Create new queue");
+    ADD_COMMAND(new,
+                " [-p|-c]        | Create new queue, with pooled elements if "
+                "-p is given, compact if -c is given");
     ADD_COMMAND(free, "                | Delete queue");
     ADD_COMMAND(
         ih,
@@ -851,26 +1846,92 @@ static void console_init()
         rt,
         " [str]          | Remove from tail of queue.  Optionally compare "
         "to expected value str");
-    ADD_COMMAND(
-        rhq,
-        "                | Remove from head of queue without reporting value.");
+    ADD_COMMAND(rhq,
+                " [n]            | Remove from head of queue n times without "
+                "reporting value. (default: n == 1)");
     ADD_COMMAND(reverse, "                | Reverse queue");
     ADD_COMMAND(sort, "                | Sort queue in ascending order");
     ADD_COMMAND(
         size, " [n]            | Compute queue size n times (default: n == 1)");
     ADD_COMMAND(show, "                | Show queue contents");
     ADD_COMMAND(dm, "                | Delete middle node in queue");
-    ADD_COMMAND(
-        dedup, "                | Delete all nodes that have duplicate string");
+    ADD_COMMAND(dedup,
+                " [-u]           | Delete all nodes that have duplicate "
+                "string, -u for unsorted queues");
     ADD_COMMAND(swap,
                 "                | Swap every two adjacent nodes in queue");
-    ADD_COMMAND(shuffle, "                | Shuffle queue");
+    ADD_COMMAND(shuffle,
+                " [seed]         | Shuffle queue, reproducibly if seed is "
+                "given");
+    ADD_COMMAND(save,
+                " file           | Save the strings of the queue to a "
+                "snapshot file");
+    ADD_COMMAND(load,
+                " [-r] file      | Insert the strings of a snapshot file at "
+                "tail of queue, and remove the file with -r");
+    ADD_COMMAND(bench,
+                " [-j] [-x] [-s size] [-r rounds] op n [len] | Benchmark n "
+                "runs of op, or rounds of it on n elements for whole queue "
+                "ops, on a scattered list with -x");
+    ADD_COMMAND(mt,
+                " [-l] producers consumers ops | Pass ops strings from each "
+                "producer thread to consumer threads through the concurrent "
+                "queue, or a locked list with -l");
+    ADD_COMMAND(ws,
+                " [-l] workers depth | Fan a tree of tasks of the given depth "
+                "out over worker threads stealing from each other, or sharing "
+                "a locked list with -l");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("sortalgo", &q_sort_algo,
+              "Sorting algorithm of sort (0: merge, 1: radix)", NULL);
+    add_param("threads", &q_sort_threads, "Number of threads for merge sort",
+              NULL);
+    add_param("bulk", &bulk_mode,
+              "Insert and remove repeatedly with the bulk queue functions",
+              NULL);
+    add_param("nocopy", &nocopy_mode,
+              "Remove without copying the string out of the element", NULL);
+    add_param("harness", &harness_level,
+              "Checks of the allocations (0: fast, 1: safe, 2: paranoid)",
+              set_harness);
+    add_param("hugepage", &hugepage_mode,
+              "Map the slabs of big pooled queues on huge pages (0: off, 1: "
+              "transparent, 2: explicit)",
+              set_hugepage);
+    add_param("profile", &profile_mode,
+              "Profile the allocations of the commands (0: off, 1: after "
+              "each command, 2: per command at quit)",
+              set_profile);
+    add_param("seed", &random_seed,
+              "Seed of the random strings and shuffles (0: from /dev/urandom)",
+              set_seed);
+    add_param("strkern", &strkern,
+              "String kernels of the queue (0: libc, 1: scalar, 2: SSE2, 3: "
+              "AVX2, 4: NEON)",
+              set_strkern);
+    add_param("fullcheck", &fullcheck,
+              "Check the whole queue every time it is shown", NULL);
+    add_param("measure", &n_measure,
+              "Number of measurements per batch of simulation", set_measure);
+    add_param("simthreads", &dudect_threads,
+              "Number of threads measuring in simulation, 0 for one per "
+              "isolated CPU",
+              NULL);
+    add_param("crop", &dudect_crop,
+              "Also run the cropped and second order t-tests in simulation",
+              NULL);
+    add_param("prebuilt", &measure_prebuilt,
+              "Build the queues of simulation up front from pooled elements",
+              NULL);
+    add_param("timer", &cpucycles_timer,
+              "Timer of simulation (0: rdtsc, 1: lfence, 2: rdtscp, "
+              "3: perf cycles, 4: perf instructions)",
+              set_timer);
 }
 
 /* Signal handlers */
@@ -894,20 +1955,23 @@ static void queue_init()
 {
     fail_count = 0;
     l_meta.l = NULL;
+    l_meta.cq = NULL;
     signal(SIGSEGV, sigsegvhandler);
     signal(SIGALRM, sigalrmhandler);
+    cpucycles_select(cpucycles_timer);
+    strkern_select(strkern_best());
 }
 
 static bool queue_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (lcnt > big_list_size)
-        set_cautious_mode(false);
-
-    if (exception_setup(true))
-        q_free(l_meta.l);
+    if (exception_setup(true)) {
+        if (l_meta.cq)
+            cq_free(l_meta.cq);
+        else
+            q_free(l_meta.l);
+    }
     exception_cancel();
-    set_cautious_mode(true);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -921,9 +1985,12 @@ static bool queue_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf("Usage: %s [-h] [-c] [-f IFILE][-b BFILE][-v VLEVEL][-l LFILE]\n",
+           cmd);
     printf("\t-h         Print this information\n");
+    printf("\t-c         Create compact queues by default\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
+    printf("\t-b BFILE   Replay the binary trace BFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
     exit(0);
@@ -972,21 +2039,31 @@ int main(int argc, char *argv[])
     /* To hold input file name */
     char buf[BUFSIZE];
     char *infile_name = NULL;
+    char bbuf[BUFSIZE];
+    char *binfile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hcv:f:b:l:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
             break;
+        case 'c':
+            compact_default = true;
+            break;
         case 'f':
             strncpy(buf, optarg, BUFSIZE);
             buf[BUFSIZE - 1] = '\0';
             infile_name = buf;
             break;
+        case 'b':
+            strncpy(bbuf, optarg, BUFSIZE);
+            bbuf[BUFSIZE - 1] = '\0';
+            binfile_name = bbuf;
+            break;
         case 'v': {
             char *endptr;
             errno = 0;
@@ -1009,13 +2086,12 @@ int main(int argc, char *argv[])
         }
     }
 
-    srand((unsigned int) (time(NULL)));
     queue_init();
     init_cmd();
     console_init();
 
     /* Initialize linenoise only when infile_name not exist */
-    if (!infile_name) {
+    if (!infile_name && !binfile_name) {
         /* Trigger call back function(auto completion) */
         linenoiseSetCompletionCallback(completion);
 
@@ -1030,9 +2106,14 @@ int main(int argc, char *argv[])
         set_logfile(logfile_name);
 
     add_quit_helper(queue_quit);
+    add_quit_helper(profile_quit);
+    set_post_cmd_helper(profile_cmd);
 
     bool ok = true;
-    ok = ok && run_console(infile_name);
+    if (binfile_name)
+        ok = ok && run_binary_trace(binfile_name);
+    else
+        ok = ok && run_console(infile_name);
 
     /* Do finish_cmd() before check whether ok is true or false */
     ok = finish_cmd() && ok;
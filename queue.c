@@ -1,10 +1,14 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #include "harness.h"
 #include "queue.h"
+#include "random.h"
+#include "strkern.h"
 
 /* Notice: sometimes, Cppcheck would find the potential NULL pointer bugs,
  * but some of them cannot occur. You can suppress them by adding the
@@ -24,46 +28,233 @@
            (node != head) ? list_entry(node, element_t, list)->value : "head")
 #endif /* DEBUG_PRINT */
 
+/* Strings up to this size, including the terminator, are stored inline in
+ * pooled elements, which keeps a slot at 64 bytes
+ */
+#define POOL_INLINE_SIZE 16
+
+/* Number of elements carved out of every slab drawn from malloc */
+#define POOL_SLAB_ELEMENTS 256
+
+/* Size of the slabs after the first one when they can be mapped on huge pages
+ * by test_mmap(), a little less than a huge page to leave room for the harness
+ */
+#define POOL_MAPPED_SIZE (((size_t) 2 << 20) - 64)
+
+/* Slot of a slab, the element followed by its inline string storage */
+typedef struct {
+    element_t elm;
+    char inline_value[POOL_INLINE_SIZE];
+} pool_slot_t;
+
+/* Slab of elements, drawn from the allocator or mapped at once */
+typedef struct pool_slab {
+    struct pool_slab *next;
+    size_t size; /* number of slots */
+    bool mapped; /* by test_mmap() rather than malloc() */
+    pool_slot_t slots[];
+} pool_slab_t;
+
+/*
+ * Element pool of a queue.
+ * Released slots are chained through their list.next pointer.
+ */
+struct q_pool {
+    pool_slab_t *slabs;      /* all slabs, newest first */
+    pool_slot_t *free_slots; /* released slots ready for reuse */
+    size_t unused;           /* never used slots at the end of newest slab */
+    size_t in_use;           /* slots handed out, linked into queue or not */
+    bool orphaned;           /* queue is freed, wait for the last release */
+};
+
+/* Release all slabs of the pool and the pool itself */
+static void pool_destroy(struct q_pool *pool)
+{
+    pool_slab_t *slab, *next;
+
+    for (slab = pool->slabs; slab; slab = next) {
+        next = slab->next;
+        if (slab->mapped)
+            test_munmap(slab);
+        else
+            free(slab);
+    }
+    free(pool);
+}
+
+/*
+ * Take a slot out of pool and prepare its member value for value_size bytes.
+ *
+ * Return NULL if failed to allocate the space.
+ */
+static element_t *pool_alloc(struct q_pool *pool, size_t value_size)
+{
+    pool_slot_t *slot = pool->free_slots;
+
+    if (slot) {
+        pool->free_slots = (pool_slot_t *) slot->elm.list.next;
+    } else {
+        if (!pool->unused) {
+            /* small queues keep to their first slab, big ones get huge
+             * pages if there are any
+             */
+            pool_slab_t *slab = pool->slabs ? test_mmap(POOL_MAPPED_SIZE)
+                                            : NULL;
+            if (slab) {
+                slab->mapped = true;
+                slab->size = (POOL_MAPPED_SIZE - sizeof(pool_slab_t)) /
+                             sizeof(pool_slot_t);
+            } else {
+                slab = malloc(sizeof(pool_slab_t) +
+                              POOL_SLAB_ELEMENTS * sizeof(pool_slot_t));
+                if (!slab)
+                    return NULL;
+                slab->mapped = false;
+                slab->size = POOL_SLAB_ELEMENTS;
+            }
+            slab->next = pool->slabs;
+            pool->slabs = slab;
+            pool->unused = slab->size;
+        }
+        slot = &pool->slabs->slots[pool->slabs->size - pool->unused--];
+    }
+
+    if (value_size <= POOL_INLINE_SIZE) {
+        slot->elm.value = slot->inline_value;
+    } else {
+        slot->elm.value = malloc(value_size);
+        if (!slot->elm.value) {
+            slot->elm.list.next = (struct list_head *) pool->free_slots;
+            pool->free_slots = slot;
+            return NULL;
+        }
+    }
+
+    slot->elm.pool = pool;
+    pool->in_use++;
+
+    return &slot->elm;
+}
+
+/* Give the slot of a pooled element back to its pool */
+static void pool_release(element_t *elm)
+{
+    struct q_pool *pool = elm->pool;
+    pool_slot_t *slot = (pool_slot_t *) elm;
+
+    if (elm->value != slot->inline_value)
+        free(elm->value);
+
+    slot->elm.list.next = (struct list_head *) pool->free_slots;
+    pool->free_slots = slot;
+
+    if (!--pool->in_use && pool->orphaned)
+        pool_destroy(pool);
+}
+
 /* Create an empty queue */
 struct list_head *q_new()
 {
-    struct list_head *queue;
+    queue_t *q;
+
+    q = malloc(sizeof(queue_t));
+    if (!q)
+        return NULL;
+
+    INIT_LIST_HEAD(&q->head);
+    q->size = 0;
+    q->pool = NULL;
+
+    return &q->head;
+}
+
+/* Create an empty queue with pooled elements */
+struct list_head *q_new_pooled()
+{
+    struct list_head *head;
+    struct q_pool *pool;
+
+    pool = malloc(sizeof(struct q_pool));
+    if (!pool)
+        return NULL;
+
+    head = q_new();
+    if (!head) {
+        free(pool);
+        return NULL;
+    }
 
-    queue = malloc(sizeof(struct list_head));
-    if (queue)
-        INIT_LIST_HEAD(queue);
+    pool->slabs = NULL;
+    pool->free_slots = NULL;
+    pool->unused = 0;
+    pool->in_use = 0;
+    pool->orphaned = false;
+    queue_of(head)->pool = pool;
 
-    return queue;
+    return head;
+}
+
+/* Release an element, either to its pool or to the allocator */
+void q_release_element(element_t *e)
+{
+    if (e->pool) {
+        pool_release(e);
+        return;
+    }
+
+    free(e->value);
+    free(e);
 }
 
 /* Free all storage used by queue */
 void q_free(struct list_head *l)
 {
     element_t *elm, *elm_safe;
+    struct q_pool *pool;
 
     if (!l)
         return;
 
-    /* free the queue elements */
-    list_for_each_entry_safe (elm, elm_safe, l, list)
-        q_release_element(elm);
+    pool = queue_of(l)->pool;
+    if (!pool) {
+        /* free the queue elements */
+        list_for_each_entry_safe (elm, elm_safe, l, list)
+            q_release_element(elm);
+    } else {
+        /* only out-of-line strings need freeing, slabs go away in bulk */
+        list_for_each_entry (elm, l, list) {
+            if (elm->value != ((pool_slot_t *) elm)->inline_value)
+                free(elm->value);
+            pool->in_use--;
+        }
+
+        /* elements removed but not released yet keep the pool alive */
+        if (pool->in_use)
+            pool->orphaned = true;
+        else
+            pool_destroy(pool);
+    }
 
     /* free the queue itself, the list head */
-    free(l);
+    free(queue_of(l));
 }
 
 /*
  * Allocate an element_t which member value has length value_size.
+ * @q: the queue the element will be inserted into
  * @value_length: size of member value (byte)
  *
  * Return non-NULL if successful.
  * Return NULL if failed to allocate the space.
  */
-static element_t *element_alloc(size_t value_size)
+static element_t *element_alloc(queue_t *q, size_t value_size)
 {
     element_t *elm;
     char *value;
 
+    if (q->pool)
+        return pool_alloc(q->pool, value_size);
+
     value = malloc(value_size);
     if (!value)
         goto fail_alloc_value;
@@ -74,6 +265,7 @@ static element_t *element_alloc(size_t value_size)
 
     /* assemble the element_t and value */
     elm->value = value;
+    elm->pool = NULL;
 
     /* Poison the list node to prevent anyone using the unlinked list node */
 #ifdef LIST_POISONING
@@ -89,26 +281,63 @@ fail_alloc_value:
     return NULL;
 }
 
+/*
+ * Allocate an element_t holding a copy of the string s and its length.
+ * @q: the queue the element will be inserted into
+ *
+ * Return NULL if failed to allocate the space.
+ */
+static element_t *element_new(queue_t *q, const char *s)
+{
+    element_t *elm;
+    size_t len;
+
+    if (!q->pool) {
+        len = sk_len(s);
+        elm = element_alloc(q, len + 1);
+        if (!elm)
+            return NULL;
+        memcpy(elm->value, s, len + 1);
+        elm->len = len;
+        return elm;
+    }
+
+    /* measure while copying into the inline storage, so that short strings
+     * are gone through once
+     */
+    elm = pool_alloc(q->pool, POOL_INLINE_SIZE);
+    if (!elm)
+        return NULL;
+    len = sk_copy(elm->value, s, POOL_INLINE_SIZE);
+    if (len >= POOL_INLINE_SIZE) {
+        char *value = malloc(len + 1);
+        if (!value) {
+            pool_release(elm);
+            return NULL;
+        }
+        memcpy(value, s, len + 1);
+        elm->value = value;
+    }
+    elm->len = len;
+
+    return elm;
+}
+
 /* Insert an element at head of queue */
 bool q_insert_head(struct list_head *head, char *s)
 {
     element_t *elm;
-    int s_length;
 
     if (!head)
         return false;
 
-    s_length = strlen(s);
-    elm = element_alloc(s_length + 1);
+    elm = element_new(queue_of(head), s);
     if (!elm)
         return false;
 
-    /* copy the string content */
-    memcpy(elm->value, s, s_length);
-    elm->value[s_length] = '\0';
-
     /* add the list into the head of head */
     list_add(&elm->list, head);
+    queue_of(head)->size++;
 
     return true;
 }
@@ -117,28 +346,86 @@ bool q_insert_head(struct list_head *head, char *s)
 bool q_insert_tail(struct list_head *head, char *s)
 {
     element_t *elm;
-    int s_length;
 
     if (!head)
         return false;
 
-    s_length = strlen(s);
-    elm = element_alloc(s_length + 1);
+    elm = element_new(queue_of(head), s);
     if (!elm)
         return false;
 
-    /* copy the string content */
-    memcpy(elm->value, s, s_length);
-    elm->value[s_length] = '\0';
-
     /* add the list into the tail of head */
     list_add_tail(&elm->list, head);
+    queue_of(head)->size++;
 
     return true;
 }
 
-/* Remove an element from head of queue */
-element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+/*
+ * Build a private chain of elements holding copies of the n strings of s.
+ * @q: the queue the elements will be spliced into
+ * @chain: an empty list receiving the elements
+ * @reversed: put s[n - 1] first instead of s[0]
+ *
+ * Return false, with the chain released again, if failed to allocate.
+ */
+static bool build_chain(queue_t *q,
+                        struct list_head *chain,
+                        char *s[],
+                        int n,
+                        bool reversed)
+{
+    element_t *elm, *safe;
+
+    for (int i = 0; i < n; i++) {
+        elm = element_new(q, s[i]);
+        if (!elm)
+            goto fail_alloc_elm;
+
+        if (reversed)
+            list_add(&elm->list, chain);
+        else
+            list_add_tail(&elm->list, chain);
+    }
+
+    return true;
+
+fail_alloc_elm:
+    list_for_each_entry_safe (elm, safe, chain, list)
+        q_release_element(elm);
+    return false;
+}
+
+/* Insert n elements at head of queue */
+bool q_insert_head_n(struct list_head *head, char *s[], int n)
+{
+    LIST_HEAD(chain);
+
+    if (!head || n < 0 || !build_chain(queue_of(head), &chain, s, n, true))
+        return false;
+
+    list_splice(&chain, head);
+    queue_of(head)->size += n;
+
+    return true;
+}
+
+/* Insert n elements at tail of queue */
+bool q_insert_tail_n(struct list_head *head, char *s[], int n)
+{
+    LIST_HEAD(chain);
+
+    if (!head || n < 0 || !build_chain(queue_of(head), &chain, s, n, false))
+        return false;
+
+    list_splice_tail(&chain, head);
+    queue_of(head)->size += n;
+
+    return true;
+}
+
+/* Detach the element at head of queue, leaving its string in place */
+element_t *q_pop_head_view(struct list_head *head, size_t *len)
 {
     element_t *elm;
 
@@ -147,20 +434,18 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
 
     elm = list_first_entry(head, element_t, list);
 
-    /* copy the string if sp is non-NULL */
-    if (sp) {
-        memcpy(sp, elm->value, bufsize - 1);
-        sp[bufsize - 1] = '\0';
-    }
-
     /* remove the list from head */
     list_del(&elm->list);
+    queue_of(head)->size--;
+
+    if (len)
+        *len = elm->len;
 
     return elm;
 }
 
-/* Remove an element from tail of queue */
-element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
+/* Detach the element at tail of queue, leaving its string in place */
+element_t *q_pop_tail_view(struct list_head *head, size_t *len)
 {
     element_t *elm;
 
@@ -169,52 +454,131 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
 
     elm = list_last_entry(head, element_t, list);
 
-    /* copy the string if sp is non-NULL */
-    if (sp) {
-        memcpy(sp, elm->value, bufsize - 1);
-        sp[bufsize - 1] = '\0';
-    }
-
     /* remove the list from head */
     list_del(&elm->list);
+    queue_of(head)->size--;
+
+    if (len)
+        *len = elm->len;
+
+    return elm;
+}
+
+/*
+ * Copy the string of a removed element into sp, if sp is non-NULL.
+ * Only the string itself is read, at most bufsize - 1 bytes of it.
+ */
+static inline void copy_value(const element_t *elm, char *sp, size_t bufsize)
+{
+    size_t len;
+
+    if (!sp || !bufsize)
+        return;
+
+    len = elm->len < bufsize - 1 ? elm->len : bufsize - 1;
+    memcpy(sp, elm->value, len);
+    sp[len] = '\0';
+}
+
+/* Remove an element from head of queue */
+element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+{
+    element_t *elm = q_pop_head_view(head, NULL);
+
+    if (elm)
+        copy_value(elm, sp, bufsize);
 
     return elm;
 }
 
+/* Remove an element from tail of queue */
+element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
+{
+    element_t *elm = q_pop_tail_view(head, NULL);
+
+    if (elm)
+        copy_value(elm, sp, bufsize);
+
+    return elm;
+}
+
+/* Remove up to n elements from head of queue onto the tail of out */
+int q_remove_head_n(struct list_head *head, struct list_head *out, int n)
+{
+    struct list_head *node;
+    int size, cut;
+    LIST_HEAD(removed);
+
+    if (!head || !out || n <= 0)
+        return 0;
+
+    size = q_size(head);
+    cut = n < size ? n : size;
+    if (cut == size) {
+        list_splice_tail_init(head, out);
+        queue_of(head)->size = 0;
+        return cut;
+    }
+
+    /* find the last node to remove, walking in from the nearer end */
+    if (cut <= size / 2) {
+        node = head->next;
+        for (int i = 1; i < cut; i++)
+            node = node->next;
+    } else {
+        node = head->prev;
+        for (int i = size; i > cut; i--)
+            node = node->prev;
+    }
+
+    list_cut_position(&removed, head, node);
+    list_splice_tail(&removed, out);
+    queue_of(head)->size -= cut;
+
+    return cut;
+}
+
 /* Return number of elements in queue */
 int q_size(struct list_head *head)
 {
     if (!head)
         return 0;
 
-    int len = 0;
-    struct list_head *li;
-
-    list_for_each (li, head)
-        ++len;
-
-    return len;
+    return queue_of(head)->size;
 }
 
 /* Delete the middle node in queue */
 bool q_delete_mid(struct list_head *head)
 {
     // https://leetcode.com/problems/delete-the-middle-node-of-a-linked-list/
-    struct list_head *fast, *slow;
+    struct list_head *slow;
+    int n, steps;
 
     if (!head || list_empty(head))
         return false;
 
-    /* two traverses with different speeds until fast meets head */
-    fast = head->next;
-    slow = head->next;
-    while (fast != head && fast->next != head) {
-        slow = slow->next; /* will stop on the middle node */
-        fast = fast->next->next;
+    /* the size is known, so walk to the middle node (index n / 2) from the
+     * nearer end, a single chain of loads rather than the two of a fast and
+     * a slow pointer
+     */
+    n = queue_of(head)->size;
+    if (n / 2 <= n - 1 - n / 2) {
+        slow = head->next;
+        for (steps = n / 2; steps > 0; steps--) {
+            list_prefetch(slow->next->next);
+            slow = slow->next;
+        }
+    } else {
+        slow = head->prev;
+        for (steps = n - 1 - n / 2; steps > 0; steps--) {
+            list_prefetch(slow->prev->prev);
+            slow = slow->prev;
+        }
     }
 
     /* remove the middle node from head */
     list_del(slow);
+    queue_of(head)->size--;
 
     /* delete the relative element */
     q_release_element(list_entry(slow, element_t, list));
@@ -237,12 +601,14 @@ bool q_delete_dup(struct list_head *head)
         return true;
 
     /* traverse the whole head and delete the duplicate nodes one by one */
-    list_for_each_entry_safe (elm, next_elm, head, list) {
-        int cmp_result =
-            (elm->list.next != head) && !strcmp(elm->value, next_elm->value);
+    list_for_each_entry_safe_prefetch (elm, next_elm, head, list) {
+        int cmp_result = (elm->list.next != head) &&
+                         sk_equal(elm->value, elm->len, next_elm->value,
+                                  next_elm->len);
         if (cmp_result || found_dup) {
             list_del(&elm->list);
             q_release_element(elm);
+            queue_of(head)->size--;
             found_dup = cmp_result;
         }
     }
@@ -250,6 +616,129 @@ bool q_delete_dup(struct list_head *head)
     return true;
 }
 
+/* Usual size of an arena chunk for the keys of q_delete_dup_unsorted() */
+#define ARENA_CHUNK_SIZE 4096
+
+/* Chunk of the append-only key store, chunks are linked newest first */
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used, cap;
+    char data[];
+};
+
+/* Slot of the string table of q_delete_dup_unsorted() */
+struct dup_slot {
+    uint64_t hash;
+    const char *key;  /* copy of the string in the arena, NULL if unused */
+    element_t *first; /* first occurrence, NULL once it has been deleted */
+};
+
+/* 64-bit FNV-1a hash of a string, it also reports the string length */
+static uint64_t str_hash(const char *s, size_t *len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const char *p;
+
+    for (p = s; *p; p++)
+        h = (h ^ (unsigned char) *p) * 0x100000001b3ULL;
+    *len = p - s;
+    return h;
+}
+
+/*
+ * Copy size bytes of s into the arena.
+ *
+ * Return NULL if failed to allocate a new chunk.
+ */
+static char *arena_dup(struct arena_chunk **arena, const char *s, size_t size)
+{
+    struct arena_chunk *chunk = *arena;
+
+    if (!chunk || chunk->cap - chunk->used < size) {
+        size_t cap = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(struct arena_chunk) + cap);
+        if (!chunk)
+            return NULL;
+        chunk->next = *arena;
+        chunk->used = 0;
+        chunk->cap = cap;
+        *arena = chunk;
+    }
+
+    char *dst = chunk->data + chunk->used;
+    memcpy(dst, s, size);
+    chunk->used += size;
+    return dst;
+}
+
+/* Delete all nodes whose string appears more than once, in any position */
+bool q_delete_dup_unsorted(struct list_head *head)
+{
+    struct arena_chunk *arena = NULL, *chunk;
+    struct dup_slot *table;
+    element_t *elm, *next_elm;
+    size_t mask, nslots = 2;
+    bool ok = true;
+
+    if (!head)
+        return false;
+
+    if (list_empty(head) || list_is_singular(head))
+        return true;
+
+    /* the table never holds more keys than nodes, keep it half empty */
+    while (nslots < 2 * (size_t) q_size(head))
+        nslots <<= 1;
+    mask = nslots - 1;
+    table = malloc(nslots * sizeof(struct dup_slot));
+    if (!table)
+        return false;
+    memset(table, 0, nslots * sizeof(struct dup_slot));
+
+    /* The string of a deleted node is gone, so the table keeps its own copy
+     * for the later occurrences to compare against.
+     */
+    list_for_each_entry_safe (elm, next_elm, head, list) {
+        size_t len;
+        uint64_t hash = str_hash(elm->value, &len);
+        size_t i = hash & mask;
+
+        while (table[i].key &&
+               (table[i].hash != hash || strcmp(table[i].key, elm->value)))
+            i = (i + 1) & mask;
+
+        if (!table[i].key) {
+            /* first occurrence, keep it until its string shows up again */
+            table[i].key = arena_dup(&arena, elm->value, len + 1);
+            if (!table[i].key) {
+                ok = false;
+                break;
+            }
+            table[i].hash = hash;
+            table[i].first = elm;
+            continue;
+        }
+
+        if (table[i].first) {
+            list_del(&table[i].first->list);
+            q_release_element(table[i].first);
+            queue_of(head)->size--;
+            table[i].first = NULL;
+        }
+        list_del(&elm->list);
+        q_release_element(elm);
+        queue_of(head)->size--;
+    }
+
+    for (; arena; arena = chunk) {
+        chunk = arena->next;
+        free(arena);
+    }
+    free(table);
+
+    return ok;
+}
+
 /* Swap every two adjacent nodes */
 void q_swap(struct list_head *head)
 {
@@ -278,29 +767,6 @@ void q_swap(struct list_head *head)
     } while (a != head && b != head);
 }
 
-/*
- * Attempt to swap two list nodes.
- * @a: the list node swaps with b
- * @b: the list node swaps with a
- *
- * a,b MUST be different.
- */
-static inline void list_swap(struct list_head *a, struct list_head *b)
-{
-    struct list_head *pos = b->prev;
-
-    list_del(b);
-    /* replace a by b */
-    b->prev = a->prev;
-    b->next = a->next;
-    a->next->prev = b;
-    a->prev->next = b;
-    if (pos == a)
-        pos = b;
-    /* a add before pos */
-    list_add(a, pos);
-}
-
 /*
  * Reverse elements in queue
  * No effect if q is NULL or empty
@@ -315,7 +781,7 @@ void q_reverse(struct list_head *head)
     if (!head || list_empty(head) || list_is_singular(head))
         return;
 
-    list_for_each_safe (cur, next, head) {
+    list_for_each_safe_prefetch (cur, next, head) {
         tmp = cur->next;
         cur->next = cur->prev;
         cur->prev = tmp;
@@ -327,6 +793,44 @@ void q_reverse(struct list_head *head)
     cur->prev = tmp;
 }
 
+/* Number of leading bytes of a string captured in element_t.key */
+#define KEY_PREFIX_LEN sizeof(uint64_t)
+
+/*
+ * Pack the first KEY_PREFIX_LEN bytes of s in big-endian order, zero padded
+ * after the terminator, so that comparing keys as integers orders them like
+ * strcmp() orders the prefixes.
+ */
+static inline uint64_t key_prefix(const char *s, size_t len)
+{
+    uint64_t key = 0;
+
+    for (size_t i = 0; i < KEY_PREFIX_LEN && i < len; i++) {
+        unsigned int shift = 8 * (KEY_PREFIX_LEN - 1 - i);
+        key |= (uint64_t) (unsigned char) s[i] << shift;
+    }
+
+    return key;
+}
+
+/*
+ * Compare two elements whose keys are captured.
+ * Only fall back to the rest of the strings when the prefixes tie and the
+ * strings go on.
+ */
+static inline int elm_cmp(const element_t *a, const element_t *b)
+{
+    if (a->key != b->key)
+        return a->key < b->key ? -1 : 1;
+
+    /* both strings ended within the prefix */
+    if (!(a->key & 0xff))
+        return 0;
+
+    return sk_cmp(a->value + KEY_PREFIX_LEN, a->len - KEY_PREFIX_LEN,
+                  b->value + KEY_PREFIX_LEN, b->len - KEY_PREFIX_LEN);
+}
+
 static struct list_head *merge(struct list_head *a, struct list_head *b)
 {
     /* head initial value is meaningless, just for satisfying cppcheck */
@@ -336,7 +840,7 @@ static struct list_head *merge(struct list_head *a, struct list_head *b)
     for (;;) {
         element_t *elm_a = list_entry(a, element_t, list);
         element_t *elm_b = list_entry(b, element_t, list);
-        if (strcmp(elm_a->value, elm_b->value) <= 0) {
+        if (elm_cmp(elm_a, elm_b) <= 0) {
             *tail = a;
             tail = &a->next;
             a = a->next;
@@ -368,7 +872,7 @@ static void merge_restore(struct list_head *head,
     for (;;) {
         element_t *elm_a = list_entry(a, element_t, list);
         element_t *elm_b = list_entry(b, element_t, list);
-        if (strcmp(elm_a->value, elm_b->value) <= 0) {
+        if (elm_cmp(elm_a, elm_b) <= 0) {
             tail->next = a;
             a->prev = tail;
             tail = a;
@@ -403,9 +907,9 @@ static void merge_restore(struct list_head *head,
 }
 
 /*
- * Sort elements of queue in ascending order
- * No effect if q is NULL or empty. In addition, if q has only one
- * element, do nothing.
+ * Sort a NULL-terminated list of at least two nodes whose key prefixes are
+ * captured, and merge the pending lists down to two. The newer one is
+ * returned and the older one is stored at *older.
  *
  * From Linux: lib/list_sort.c
  * bottom-up merge sort (not fully-eager):
@@ -423,23 +927,16 @@ static void merge_restore(struct list_head *head,
  *      /     /         head --> o --> o --> NULL
  *    NULL  NULL             next
  * (older)  (newer)
+ *
+ * The key prefix of every element is captured into the node beforehand, so
+ * that most comparisons are decided without touching the strings.
  */
-void q_sort(struct list_head *head)
+static struct list_head *sort_pending(struct list_head *list,
+                                      struct list_head **older)
 {
-    struct list_head *list, *pending;
+    struct list_head *pending = NULL;
     unsigned long count = 0;
 
-    if (!head)
-        return;
-
-    list = head->next;
-    /* if head is empty or singular */
-    if (list == head->prev)
-        return;
-
-    pending = NULL;
-    head->prev->next = NULL; /* break the cycle of doubly linked list */
-
     /* bottom-up merge sort */
     do {
         int bits;
@@ -466,7 +963,7 @@ void q_sort(struct list_head *head)
         ++count;
     } while (list);
 
-    /* all lists are in pending, merge them */
+    /* all lists are in pending, merge them but the oldest one */
     list = pending;
     pending = list->prev;
     for (;;) {
@@ -479,33 +976,358 @@ void q_sort(struct list_head *head)
         pending = next;
     }
 
+    *older = pending;
+    return list;
+}
+
+/* Merge sort the queue, which has at least two elements */
+static void merge_sort(struct list_head *head)
+{
+    struct list_head *list, *older;
+    element_t *elm;
+
+    /* capture the key prefixes in a single pass */
+    list_for_each_entry (elm, head, list)
+        elm->key = key_prefix(elm->value, elm->len);
+
+    head->prev->next = NULL; /* break the cycle of doubly linked list */
+    list = sort_pending(head->next, &older);
+
+    /* final merge and restore the doubly linked list */
+    merge_restore(head, older, list);
+}
+
+/* Upper bound of threads sorting a queue */
+#define SORT_MAX_THREADS 64
+
+/* Fewest elements worth sorting in a thread of their own */
+#define SORT_MIN_RUN 4096
+
+/* Sort a NULL-terminated run of at least two nodes, in place of *arg */
+static void *sort_run(void *arg)
+{
+    struct list_head **run = arg, *older, *newer;
+
+    newer = sort_pending(*run, &older);
+    *run = merge(older, newer);
+
+    return NULL;
+}
+
+/* Merge the two adjacent sorted runs at arg into the first one */
+static void *merge_runs(void *arg)
+{
+    struct list_head **run = arg;
+
+    run[0] = merge(run[0], run[1]);
+
+    return NULL;
+}
+
+/*
+ * Call fn on &runs[i * stride] for 0 <= i < n, each in a thread of its own
+ * but the first one which is run by the caller. If a thread cannot be
+ * created, the caller takes over its part.
+ */
+static void run_parallel(void *(*fn)(void *),
+                         struct list_head **runs,
+                         int n,
+                         int stride)
+{
+    pthread_t tid[SORT_MAX_THREADS];
+    bool spawned[SORT_MAX_THREADS];
+
+    for (int i = 1; i < n; i++)
+        spawned[i] = !pthread_create(&tid[i], NULL, fn, &runs[i * stride]);
+
+    fn(&runs[0]);
+
+    for (int i = 1; i < n; i++) {
+        if (spawned[i])
+            pthread_join(tid[i], NULL);
+        else
+            fn(&runs[i * stride]);
+    }
+}
+
+/*
+ * Merge sort the queue with up to threads threads.
+ *
+ * The list is cut into contiguous runs by its cached size, each run is sorted
+ * by its own thread, and the runs are merged pairwise in parallel rounds until
+ * two are left for the final merge_restore(). Runs are always merged with the
+ * earlier one first, so the sort stays stable.
+ */
+static void parallel_merge_sort(struct list_head *head, int threads)
+{
+    struct list_head *runs[SORT_MAX_THREADS];
+    struct list_head *node, *last = NULL;
+    sigset_t mask, old_mask;
+    int n = q_size(head), len;
+
+    if (threads > SORT_MAX_THREADS)
+        threads = SORT_MAX_THREADS;
+    if (threads > n / SORT_MIN_RUN)
+        threads = n / SORT_MIN_RUN;
+    if (threads < 2) {
+        merge_sort(head);
+        return;
+    }
+
+    /* cut into runs and capture the key prefixes on the way */
+    len = (n + threads - 1) / threads;
+    head->prev->next = NULL; /* break the cycle of doubly linked list */
+    node = head->next;
+    for (int i = 0; i < threads; i++) {
+        runs[i] = node;
+        for (int j = 0; j < len && node; j++) {
+            element_t *elm = list_entry(node, element_t, list);
+            elm->key = key_prefix(elm->value, elm->len);
+            last = node;
+            node = node->next;
+        }
+        last->next = NULL;
+    }
+
+    /* Keep asynchronous signals away from the sorting threads, and hold them
+     * in this thread until the list is whole again, so that a signal handler
+     * never sees the list half sorted. Faults are still delivered at once.
+     */
+    sigfillset(&mask);
+    sigdelset(&mask, SIGSEGV);
+    sigdelset(&mask, SIGBUS);
+    sigdelset(&mask, SIGFPE);
+    sigdelset(&mask, SIGILL);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    run_parallel(sort_run, runs, threads, 1);
+    for (n = threads; n > 2; n = (n + 1) / 2) {
+        run_parallel(merge_runs, runs, n / 2, 2);
+        for (int i = 0; i < n / 2; i++)
+            runs[i] = runs[2 * i];
+        if (n & 1)
+            runs[n / 2] = runs[n - 1];
+    }
+
     /* final merge and restore the doubly linked list */
-    merge_restore(head, pending, list);
+    merge_restore(head, runs[0], runs[1]);
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+/* Deepest byte position distributed by radix sort, beyond it merge sort */
+#define RADIX_MAX_DEPTH 32
+
+/* Buckets with at most this many elements are insertion sorted */
+#define RADIX_SMALL 16
+
+/* Elements sharing the same byte at the current depth */
+struct radix_bucket {
+    struct list_head *head, *tail;
+    size_t n;
+};
+
+/* Scratch buffer of radix_sort_chain(), one set of buckets per depth.
+ * Every bucket is left empty after use.
+ */
+static struct radix_bucket radix_scratch[RADIX_MAX_DEPTH][256];
+
+/*
+ * Stable insertion sort of a NULL-terminated chain linked by next, whose
+ * strings all share their first depth bytes.
+ * @tailp: the last node of the sorted chain is stored here
+ */
+static struct list_head *insertion_sort_chain(struct list_head *list,
+                                              size_t depth,
+                                              struct list_head **tailp)
+{
+    struct list_head *sorted = NULL, *tail = NULL;
+
+    while (list) {
+        struct list_head *node = list, **pos = &sorted;
+        const element_t *e = list_entry(node, element_t, list);
+
+        list = list->next;
+        /* insert after all the nodes not greater than node */
+        while (*pos) {
+            const element_t *t = list_entry(*pos, element_t, list);
+            if (sk_cmp(t->value + depth, t->len - depth, e->value + depth,
+                       e->len - depth) > 0)
+                break;
+            pos = &(*pos)->next;
+        }
+        node->next = *pos;
+        *pos = node;
+        if (!node->next)
+            tail = node;
+    }
+
+    *tailp = tail;
+    return sorted;
+}
+
+/*
+ * MSD radix sort of a NULL-terminated chain linked by next, whose strings all
+ * share their first depth bytes and go on for at least one more byte.
+ * @tailp: the last node of the sorted chain is stored here
+ *
+ * Nodes are distributed into buckets by their byte at depth, in order, so the
+ * sort is stable. Strings ending at depth are all equal and sort first.
+ */
+static struct list_head *radix_sort_chain(struct list_head *list,
+                                          size_t depth,
+                                          struct list_head **tailp)
+{
+    struct radix_bucket *bucket;
+    struct list_head *sorted = NULL, **link = &sorted, *tail = NULL;
+    unsigned int lo = 255, hi = 0;
+
+    if (depth >= RADIX_MAX_DEPTH) {
+        /* too long common prefix, leave the rest to merge sort */
+        LIST_HEAD(tmp);
+        tmp.next = list;
+        for (tail = &tmp; list; tail = list, list = list->next)
+            list->prev = tail;
+        tail->next = &tmp;
+        tmp.prev = tail;
+
+        merge_sort(&tmp);
+        tmp.prev->next = NULL;
+        *tailp = tmp.prev;
+        return tmp.next;
+    }
+
+    bucket = radix_scratch[depth];
+    while (list) {
+        struct list_head *node = list;
+        unsigned int c =
+            (unsigned char) list_entry(node, element_t, list)->value[depth];
+
+        list = list->next;
+        if (bucket[c].head)
+            bucket[c].tail->next = node;
+        else
+            bucket[c].head = node;
+        bucket[c].tail = node;
+        bucket[c].n++;
+        lo = c < lo ? c : lo;
+        hi = c > hi ? c : hi;
+    }
+
+    /* collect the buckets in order, sorting the deeper bytes of each */
+    for (unsigned int c = lo; c <= hi; c++) {
+        struct list_head *first = bucket[c].head, *last = bucket[c].tail;
+        size_t n = bucket[c].n;
+
+        if (!first)
+            continue;
+        bucket[c].head = bucket[c].tail = NULL;
+        bucket[c].n = 0;
+
+        last->next = NULL;
+        if (c && n > RADIX_SMALL)
+            first = radix_sort_chain(first, depth + 1, &last);
+        else if (c && n > 1)
+            first = insertion_sort_chain(first, depth + 1, &last);
+
+        *link = first;
+        link = &last->next;
+        tail = last;
+    }
+
+    *tailp = tail;
+    return sorted;
+}
+
+/* Radix sort the queue, which has at least two elements */
+static void radix_sort(struct list_head *head)
+{
+    struct list_head *list, *node, *prev, *tail;
+
+    head->prev->next = NULL; /* break the cycle of doubly linked list */
+    list = radix_sort_chain(head->next, 0, &tail);
+
+    /* restore the prev pointers and the cycle of doubly linked list */
+    prev = head;
+    for (node = list; node; node = node->next) {
+        node->prev = prev;
+        prev = node;
+    }
+    head->next = list;
+    head->prev = tail;
+    tail->next = head;
+}
+
+/* Sorting algorithm selected for q_sort() */
+int q_sort_algo = Q_SORT_MERGE;
+
+/* Number of threads merge sort may use */
+int q_sort_threads = 1;
+
+/*
+ * Sort elements of queue in ascending order
+ * No effect if q is NULL or empty. In addition, if q has only one
+ * element, do nothing.
+ */
+void q_sort(struct list_head *head)
+{
+    /* if head is NULL, empty or singular */
+    if (!head || head->next == head->prev)
+        return;
+
+    switch (q_sort_algo) {
+    case Q_SORT_RADIX:
+        radix_sort(head);
+        break;
+    default:
+        if (q_sort_threads > 1)
+            parallel_merge_sort(head, q_sort_threads);
+        else
+            merge_sort(head);
+        break;
+    }
 }
 
 /*
  * Attempt to shuffle the queue by Fisher-Yates shuffle
  * @head: the queue's head
+ *
+ * The nodes are gathered into a temporary array, shuffled there and relinked
+ * in one pass. Random numbers come from the seedable generator in random.h,
+ * so a shuffle can be reproduced by seeding it with prng_seed() beforehand.
+ * The queue is left unchanged if the array cannot be allocated.
  */
 void q_shuffle(struct list_head *head)
 {
-    struct list_head *cur, *next, *swap_node;
-    int n = q_size(head);
+    struct list_head **nodes, *node, *prev;
+    int n = q_size(head), i = 0;
 
     if (n < 2)
         return;
 
-    srand(time(NULL));
-    list_for_each_safe (cur, next, head) {
-        if (n-- == 1)
-            break;
+    nodes = malloc(n * sizeof(struct list_head *));
+    if (!nodes)
+        return;
+
+    list_for_each (node, head)
+        nodes[i++] = node;
 
-        int idx = rand() % (n + 1);
-        for (swap_node = head->prev; idx--; swap_node = swap_node->prev)
-            ;
-        if (swap_node != cur)
-            list_swap(swap_node, cur);
-        if (swap_node == next)
-            next = cur;
+    for (i = n - 1; i > 0; i--) {
+        int j = prng_bounded(i + 1);
+        node = nodes[i];
+        nodes[i] = nodes[j];
+        nodes[j] = node;
     }
+
+    /* relink the nodes in their shuffled order */
+    prev = head;
+    for (i = 0; i < n; i++) {
+        prev->next = nodes[i];
+        nodes[i]->prev = prev;
+        prev = nodes[i];
+    }
+    prev->next = head;
+    head->prev = prev;
+
+    free(nodes);
 }
@@ -9,20 +9,51 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include "list.h"
 
+struct q_pool;
+
 /**
  * element_t - Linked list element
  * @value: pointer to array holding string
+ * @len: length of @value, not counting the terminator
  * @list: node of a doubly-linked list
+ * @pool: element pool the element was carved from, NULL if allocated alone
+ * @key: big-endian prefix of @value, only valid while q_sort() is running
  *
  * @value needs to be explicitly allocated and freed
  */
 typedef struct {
     char *value;
+    size_t len;
     struct list_head list;
+    struct q_pool *pool;
+    uint64_t key;
 } element_t;
 
+/**
+ * queue_t - Queue head carrying the metadata of a queue
+ * @head: head of the list linking all elements of the queue
+ * @size: number of elements linked into @head
+ * @pool: element pool, NULL if elements are allocated one by one
+ *
+ * The queue is handed out and operated on through its embedded @head, so the
+ * q_* functions keep taking a bare struct list_head pointer.  Every function
+ * linking or unlinking elements keeps @size up to date.
+ */
+typedef struct {
+    struct list_head head;
+    int size;
+    struct q_pool *pool;
+} queue_t;
+
+/**
+ * queue_of() - Get the queue_t a list head returned by q_new() belongs to
+ * @h: pointer to the head of the queue
+ */
+#define queue_of(h) list_entry(h, queue_t, head)
+
 /* Operations on queue */
 
 /**
@@ -32,6 +63,19 @@ typedef struct {
  */
 struct list_head *q_new();
 
+/**
+ * q_new_pooled() - Create an empty queue whose elements come from a pool
+ *
+ * Elements of the queue are carved out of slabs owned by the queue, and short
+ * strings are stored inline right after their element, so most insertions do
+ * not allocate at all. The slabs are released in bulk by q_free(). Elements
+ * removed from the queue stay valid until they are released by
+ * q_release_element(), even if the queue itself has been freed meanwhile.
+ *
+ * Return: NULL for allocation failed
+ */
+struct list_head *q_new_pooled();
+
 /**
  * q_free() - Free all storage used by queue, no effect if header is NULL
  * @head: header of queue
@@ -62,6 +106,34 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/**
+ * q_insert_head_n() - Insert n elements at the head at once
+ * @head: header of queue
+ * @s: array of the n strings would be inserted
+ * @n: number of strings
+ *
+ * The queue ends up as if q_insert_head() was called on s[0] to s[n - 1] in
+ * turn, so s[n - 1] becomes the head.  The elements are built on a private
+ * chain first, which is spliced into the queue at once.  Either all strings
+ * are inserted or none is.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_insert_head_n(struct list_head *head, char *s[], int n);
+
+/**
+ * q_insert_tail_n() - Insert n elements at the tail at once
+ * @head: header of queue
+ * @s: array of the n strings would be inserted
+ * @n: number of strings
+ *
+ * The queue ends up as if q_insert_tail() was called on s[0] to s[n - 1] in
+ * turn.  Either all strings are inserted or none is.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_insert_tail_n(struct list_head *head, char *s[], int n);
+
 /**
  * q_remove_head() - Remove the element from head of queue
  * @head: header of queue
@@ -92,22 +164,56 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize);
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
 
+/**
+ * q_pop_head_view() - Detach the element at head of queue without copying
+ * @head: header of queue
+ * @len: if non-NULL, receives the length of the string of the element
+ *
+ * Unlike q_remove_head(), the string is not copied anywhere.  The caller
+ * gets the ownership of the element and reads its value in place, then
+ * releases it with q_release_element().
+ *
+ * Return: the pointer to element, %NULL if queue is NULL or empty.
+ */
+element_t *q_pop_head_view(struct list_head *head, size_t *len);
+
+/**
+ * q_pop_tail_view() - Detach the element at tail of queue without copying
+ * @head: header of queue
+ * @len: if non-NULL, receives the length of the string of the element
+ *
+ * Return: the pointer to element, %NULL if queue is NULL or empty.
+ */
+element_t *q_pop_tail_view(struct list_head *head, size_t *len);
+
+/**
+ * q_remove_head_n() - Remove up to n elements from the head at once
+ * @head: header of queue
+ * @out: initialized list the removed elements are appended to, in order
+ * @n: number of elements to remove
+ *
+ * Like q_remove_head(), the elements are only unlinked, the caller releases
+ * them with q_release_element().
+ *
+ * Return: the number of elements removed, less than @n if the queue runs out
+ */
+int q_remove_head_n(struct list_head *head, struct list_head *out, int n);
+
 /**
  * q_release_element() - Release the element
  * @e: element would be released
  *
- * This function is intended for internal use only.
+ * This function is intended for internal use only. Pooled elements are
+ * returned to their pool, others are freed along with their string.
  */
-static inline void q_release_element(element_t *e)
-{
-    free(e->value);
-    free(e);
-}
+void q_release_element(element_t *e);
 
 /**
  * q_size() - Get the size of the queue
  * @head: header of queue
  *
+ * The size is cached in the queue_t, so this takes constant time.
+ *
  * Return: the number of elements in queue, zero if queue is NULL or empty
  */
 int q_size(struct list_head *head);
@@ -139,6 +245,20 @@ bool q_delete_mid(struct list_head *head);
  */
 bool q_delete_dup(struct list_head *head);
 
+/**
+ * q_delete_dup_unsorted() - Delete all nodes whose string appears more than
+ *                           once anywhere in the queue, keeping the order of
+ *                           the remaining nodes.
+ * @head: header of queue
+ *
+ * Unlike q_delete_dup(), the queue needs not be sorted.  Duplicates are found
+ * in a single pass with a hash table of the strings seen so far.
+ *
+ * Return: true for success, false if list is NULL or the table could not be
+ * allocated.
+ */
+bool q_delete_dup_unsorted(struct list_head *head);
+
 /**
  * q_delete_dup() - Swap every two adjacent nodes
  * @head: header of queue
@@ -164,8 +284,22 @@ void q_reverse(struct list_head *head);
  * @head: header of queue
  *
  * No effect if queue is NULL or empty. If there has only one element, do
- * nothing.
+ * nothing. The sort is stable, and the algorithm is picked by q_sort_algo.
  */
 void q_sort(struct list_head *head);
 
+/* Sorting algorithms of q_sort() */
+enum {
+    Q_SORT_MERGE, /* bottom-up merge sort ported from Linux lib/list_sort.c */
+    Q_SORT_RADIX, /* MSD radix sort on the bytes of the strings */
+};
+
+/* Sorting algorithm used by q_sort(), Q_SORT_MERGE by default */
+extern int q_sort_algo;
+
+/* Number of threads the merge sort of q_sort() may use, 1 by default.
+ * Large queues are cut into that many runs sorted in parallel.
+ */
+extern int q_sort_threads;
+
 #endif /* LAB0_QUEUE_H */
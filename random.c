@@ -1,7 +1,11 @@
 #include "random.h"
 #include <assert.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
 /* shameless stolen from ebacs */
@@ -37,3 +41,178 @@ void randombytes(uint8_t *x, size_t how_much)
         xlen -= i;
     }
 }
+
+/* xoshiro256** by David Blackman and Sebastiano Vigna
+ * https://prng.di.unimi.it/xoshiro256starstar.c
+ *
+ * Every thread draws from a stream of its own, so no lock is taken.  The
+ * streams all start from one seed: the thread seeding takes it as is, and
+ * every other thread jumps 2^128 numbers further than the previous one when
+ * it first draws, so the same seed and the same order of threads reproduce
+ * the same numbers.
+ */
+static uint64_t prng_base;                /* seed of all the streams */
+static atomic_uint prng_generation;       /* bumped by every prng_seed() */
+static atomic_uint prng_streams;          /* streams taken since */
+static pthread_once_t prng_once = PTHREAD_ONCE_INIT;
+
+static __thread uint64_t prng_state[4];
+static __thread unsigned int prng_thread_generation; /* 0 before the first */
+
+static inline uint64_t rotl(const uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t next(uint64_t *s)
+{
+    const uint64_t result = rotl(s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return result;
+}
+
+/* Advance s by 2^128 numbers, the jump function of the xoshiro authors */
+static void jump(uint64_t *s)
+{
+    static const uint64_t JUMP[] = {0x180ec6d33cfd0aba, 0xd5a61266f0c9392c,
+                                    0xa9582618e03fc9aa, 0x39abdc4529b1661c};
+    uint64_t t[4] = {0};
+
+    for (int i = 0; i < 4; i++) {
+        for (int b = 0; b < 64; b++) {
+            if (JUMP[i] & (uint64_t) 1 << b) {
+                for (int j = 0; j < 4; j++)
+                    t[j] ^= s[j];
+            }
+            next(s);
+        }
+    }
+    for (int j = 0; j < 4; j++)
+        s[j] = t[j];
+}
+
+/* Expand the seed with splitmix64 as recommended by the xoshiro authors */
+static void expand(uint64_t *s, uint64_t seed)
+{
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        s[i] = z ^ (z >> 31);
+    }
+}
+
+/* Seed from /dev/urandom, unless prng_seed() got there first */
+static void seed_randomly(void)
+{
+    uint64_t seed;
+
+    if (atomic_load(&prng_generation))
+        return;
+    randombytes((uint8_t *) &seed, sizeof(seed));
+    prng_base = seed;
+    atomic_store(&prng_generation, 1);
+}
+
+/* Set up the stream of the calling thread for the current seed */
+static void take_stream(unsigned int generation)
+{
+    unsigned int stream = atomic_fetch_add(&prng_streams, 1);
+
+    expand(prng_state, prng_base);
+    while (stream--)
+        jump(prng_state);
+    prng_thread_generation = generation;
+}
+
+void prng_seed(uint64_t seed)
+{
+    prng_base = seed;
+    atomic_store(&prng_streams, 0);
+    take_stream(atomic_fetch_add(&prng_generation, 1) + 1);
+}
+
+uint64_t prng_next(void)
+{
+    unsigned int generation = atomic_load(&prng_generation);
+
+    if (!generation) {
+        pthread_once(&prng_once, seed_randomly);
+        generation = atomic_load(&prng_generation);
+    }
+    if (prng_thread_generation != generation)
+        take_stream(generation);
+
+    return next(prng_state);
+}
+
+void prng_fill(void *buf, size_t len)
+{
+    uint8_t *x = buf;
+
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+        uint64_t r = prng_next();
+        memcpy(x, &r, sizeof(r));
+        x += sizeof(r);
+    }
+    if (len) {
+        uint64_t r = prng_next();
+        memcpy(x, &r, len);
+    }
+}
+
+void prng_chars(char *buf, size_t n, const char *charset, size_t k)
+{
+    if (k < 2) {
+        if (k)
+            memset(buf, charset[0], n);
+        return;
+    }
+
+    /* digits drawn from one number, keeping their bias below 2^-32, and at
+     * least one of a charset too big for that
+     */
+    int per_draw = 0;
+    for (uint64_t span = k; span <= UINT32_MAX; span *= k)
+        per_draw++;
+    if (per_draw < 1)
+        per_draw = 1;
+
+    while (n) {
+        uint64_t r = prng_next();
+
+        /* the base k digits of r / 2^64, most significant first */
+        for (int i = 0; i < per_draw && n; i++, n--) {
+            __uint128_t m = (__uint128_t) r * k;
+            *buf++ = charset[(uint64_t) (m >> 64)];
+            r = (uint64_t) m;
+        }
+    }
+}
+
+/* Lemire's nearly divisionless method, rejecting the biased fraction.
+ * https://arxiv.org/abs/1805.10941
+ */
+uint64_t prng_bounded(uint64_t bound)
+{
+    __uint128_t m = (__uint128_t) prng_next() * bound;
+    uint64_t low = (uint64_t) m;
+
+    if (low < bound) {
+        uint64_t threshold = -bound % bound;
+        while (low < threshold) {
+            m = (__uint128_t) prng_next() * bound;
+            low = (uint64_t) m;
+        }
+    }
+
+    return (uint64_t) (m >> 64);
+}
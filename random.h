@@ -4,13 +4,32 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/* Read from /dev/urandom, only meant for seeding */
 void randombytes(uint8_t *x, size_t xlen);
 
+/* Fast non-cryptographic pseudo-random generator (xoshiro256**).
+ * It is seeded from randombytes() on first use unless prng_seed() is called,
+ * and the same seed always reproduces the same sequence.  Every thread draws
+ * from a stream of its own, which is why seeding is only meant to be done
+ * while a single thread draws numbers.
+ */
+void prng_seed(uint64_t seed);
+uint64_t prng_next(void);
+
+/* Return a uniformly distributed number in [0, bound) */
+uint64_t prng_bounded(uint64_t bound);
+
+/* Fill len bytes of buf with random bytes */
+void prng_fill(void *buf, size_t len);
+
+/* Fill buf with n characters drawn from the first k of charset, without
+ * terminating it.  buf is left as it is if k is 0.
+ */
+void prng_chars(char *buf, size_t n, const char *charset, size_t k);
+
 static inline uint8_t randombit(void)
 {
-    uint8_t ret = 0;
-    randombytes(&ret, 1);
-    return ret & 1;
+    return prng_next() & 1;
 }
 
 #endif
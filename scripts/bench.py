@@ -0,0 +1,287 @@
+#!/usr/bin/env python3
+
+from __future__ import print_function
+import getopt
+import glob
+import json
+import math
+import os
+import subprocess
+import sys
+
+
+# Scaling benchmark of the queue operations.
+#
+# Every operation is benchmarked by the bench command of qtest on queues of
+# growing sizes. The growth of its median latency is fitted against the
+# usual complexity classes, and operations growing faster than expected are
+# flagged.  Only the queues too big for the last level cache tell how an
+# operation grows, so too small a sweep is fitted all the same, but flags
+# nothing.
+class Bench:
+
+    qtest = "./qtest"
+    compact = False
+    timeout = 300
+    strlen = 8
+
+    # Complexity classes, the exponent of n they grow like, and their model
+    classes = [
+        ("O(1)", 0.0, lambda n: 1.0),
+        ("O(log n)", 0.1, lambda n: math.log2(n)),
+        ("O(n)", 1.0, lambda n: n),
+        ("O(n log n)", 1.1, lambda n: n * math.log2(n)),
+        ("O(n^2)", 2.0, lambda n: n * n),
+    ]
+
+    # Operations of queue.h, and the class each one is expected to be in
+    expected = [
+        ("ih", "O(1)"),
+        ("it", "O(1)"),
+        ("rh", "O(1)"),
+        ("rt", "O(1)"),
+        ("size", "O(1)"),
+        ("dm", "O(n)"),
+        ("reverse", "O(n)"),
+        ("swap", "O(n)"),
+        ("dedup", "O(n)"),
+        ("dedup-u", "O(n)"),
+        ("shuffle", "O(n)"),
+        ("sort", "O(n log n)"),
+    ]
+
+    # Operations on the whole queue, run a few rounds on n elements
+    whole = ["reverse", "swap", "dedup", "dedup-u", "shuffle", "sort"]
+
+    # Slack on the exponent before growth is deemed faster than expected
+    slack = 0.25
+
+    # Bytes an element of the queue takes at least, its string and the
+    # headers of malloc and of the harness included
+    elementBytes = 128
+
+    # Size of the last level cache if it cannot be read
+    defaultCache = 32 << 20
+
+    def __init__(self, qtest="", compact=False, timeout=300):
+        if qtest != "":
+            self.qtest = qtest
+        self.compact = compact
+        self.timeout = timeout
+
+    # Size of the largest cache of the CPU, in bytes
+    def cacheSize(self):
+        best = (0, 0)
+        for d in glob.glob("/sys/devices/system/cpu/cpu0/cache/index*"):
+            try:
+                with open(os.path.join(d, "level")) as f:
+                    level = int(f.read())
+                with open(os.path.join(d, "size")) as f:
+                    size = f.read().strip()
+            except (OSError, ValueError):
+                continue
+            scale = {"K": 1 << 10, "M": 1 << 20, "G": 1 << 30}
+            if size[-1:] in scale:
+                size = int(size[:-1]) * scale[size[-1]]
+            elif size.isdigit():
+                size = int(size)
+            else:
+                continue
+            best = max(best, (level, size))
+        return best[1] if best[1] > 0 else self.defaultCache
+
+    def classIndex(self, name):
+        return [c[0] for c in self.classes].index(name)
+
+    def command(self, op, n):
+        if op in self.whole:
+            rounds = max(3, min(10, (1 << 24) // n))
+            return "bench -j -r %d %s %d %d" % (rounds, op, n, self.strlen)
+        # the element operations run from a queue of n elements
+        if self.classIndex(dict(self.expected)[op]) <= 1:
+            runs = min(1000, max(1, n // 2))
+        else:
+            runs = max(3, min(1000, (1 << 22) // n))
+        return "bench -j -s %d %s %d %d" % (n, op, runs, self.strlen)
+
+    # Median latency of op on n elements, None if it failed or timed out
+    def measure(self, op, n):
+        clist = [self.qtest, "-v", "1"]
+        if self.compact:
+            clist.append("-c")
+        cmd = self.command(op, n) + "\nquit\n"
+        try:
+            out = subprocess.run(clist, input=cmd, stdout=subprocess.PIPE,
+                                 universal_newlines=True,
+                                 timeout=self.timeout).stdout
+        except subprocess.TimeoutExpired:
+            return None
+        for line in out.splitlines():
+            if line.startswith("{"):
+                return json.loads(line)
+        return None
+
+    # Fit t = a + b * f(n) by least squares on the relative error
+    def fit(self, points, f):
+        sw = swx = swy = swxx = swxy = 0.0
+        for (n, t) in points:
+            w = 1.0 / (t * t)
+            x = f(n)
+            sw += w
+            swx += w * x
+            swy += w * t
+            swxx += w * x * x
+            swxy += w * x * t
+        den = sw * swxx - swx * swx
+        b = (sw * swxy - swx * swy) / den if den > 0 else 0.0
+        if b < 0:
+            b = 0.0
+        a = (swy - b * swx) / sw
+        return sum(((t - a - b * f(n)) / t) ** 2 for (n, t) in points)
+
+    # Slope of log(t) against log(n), the exponent t grows with
+    def slope(self, points):
+        xs = [math.log(n) for (n, t) in points]
+        ys = [math.log(t) for (n, t) in points]
+        mx = sum(xs) / len(xs)
+        my = sum(ys) / len(ys)
+        sxx = sum((x - mx) ** 2 for x in xs)
+        sxy = sum((x - mx) * (y - my) for (x, y) in zip(xs, ys))
+        return sxy / sxx if sxx > 0 else 0.0
+
+    # Exponents t grows with from each size to the next
+    def steps(self, points):
+        return [math.log(t1 / t0) / math.log(n1 / n0)
+                for ((n0, t0), (n1, t1)) in zip(points, points[1:])]
+
+    # Small queues fit in the caches and large ones do not, which makes the
+    # cost per element grow with n for a while.  Only the sizes past the last
+    # level cache, at least three of them, tell the asymptotic growth.  With
+    # fewer of them, the largest three are fitted, and the fit is not to be
+    # relied on.
+    def classify(self, points, cache):
+        past = [(n, t) for (n, t) in points if n * self.elementBytes > cache]
+        reliable = len(past) >= 3
+        points = past if reliable else points[-3:]
+        errors = [self.fit(points, c[2]) for c in self.classes]
+        best = min(range(len(errors)), key=lambda i: errors[i])
+        # prefer the slower growing class among about equally good fits, all
+        # of them are on flat and noisy measurements
+        for i in range(best):
+            if errors[i] <= errors[best] * 1.1 + 0.01 * len(points):
+                best = i
+                break
+        return best, self.slope(points), self.steps(points), reliable
+
+    def run(self, ops, sizes):
+        flagged = []
+        results = {}
+        cache = self.cacheSize()
+        if len(sizes) < 3 or sizes[-3] * self.elementBytes <= cache:
+            print("---\tWARNING: queues up to %d elements are too small to "
+                  "outgrow the %d KiB cache, nothing is flagged" %
+                  (sizes[-1], cache >> 10))
+        print("---\tOperation\tExpected\tFitted\t\tExponent")
+        for (op, expect) in self.expected:
+            if ops and op not in ops:
+                continue
+            points = []
+            timedOut = False
+            for n in sizes:
+                r = self.measure(op, n)
+                if r is None:
+                    timedOut = True
+                    break
+                points.append((n, max(r["p50"], 1)))
+                results.setdefault(op, []).append(r)
+            e = self.classIndex(expect)
+            if len(points) < 3:
+                verdict = "too slow" if timedOut else "failed"
+                print("---\t%-8s\t%-10s\t%s" % (op, expect, verdict))
+                flagged.append(op)
+                continue
+            best, exponent, steps, reliable = self.classify(points, cache)
+            # growing faster than expected from every size to the next too,
+            # not only on the whole
+            limit = self.classes[e][1] + self.slack
+            bad = reliable and best > e and exponent > limit and \
+                all(x > limit for x in steps)
+            if timedOut:
+                bad = True
+            note = ""
+            if bad:
+                note = "\tSLOWER THAN EXPECTED"
+            elif not reliable:
+                note = "\tin cache, not checked"
+            print("---\t%-8s\t%-10s\t%-10s\t%5.2f%s" %
+                  (op, expect, self.classes[best][0], exponent, note))
+            if bad:
+                flagged.append(op)
+        return flagged, results
+
+
+def usage(name):
+    print("Usage: %s [-h] [-p PROG] [-o FILE] [--compact] [--ops OPS] "
+          "[--min-size N] [--max-size N] [--timeout SEC]" % name)
+    print("  -h            Print this message")
+    print("  -p PROG       Program to benchmark")
+    print("  -o FILE       Save all the measurements to FILE as JSON")
+    print("  --compact     Benchmark the compact queue instead of the list")
+    print("  --ops OPS     Comma separated operations to benchmark")
+    print("  --min-size N  Smallest queue size (default: 1024)")
+    print("  --max-size N  Largest queue size (default: 16777216)")
+    print("  --timeout SEC Give up growing an operation after SEC per run")
+    sys.exit(0)
+
+
+def run(name, args):
+    prog = ""
+    output = ""
+    compact = False
+    ops = []
+    minSize = 1 << 10
+    maxSize = 1 << 24
+    timeout = 300
+
+    optlist, args = getopt.getopt(
+        args, 'hp:o:',
+        ['compact', 'ops=', 'min-size=', 'max-size=', 'timeout='])
+    for (opt, val) in optlist:
+        if opt == '-h':
+            usage(name)
+        elif opt == '-p':
+            prog = val
+        elif opt == '-o':
+            output = val
+        elif opt == '--compact':
+            compact = True
+        elif opt == '--ops':
+            ops = val.split(',')
+        elif opt == '--min-size':
+            minSize = int(val)
+        elif opt == '--max-size':
+            maxSize = int(val)
+        elif opt == '--timeout':
+            timeout = int(val)
+        else:
+            print("Unrecognized option '%s'" % opt)
+            usage(name)
+
+    sizes = []
+    n = minSize
+    while n <= maxSize:
+        sizes.append(n)
+        n *= 4
+
+    b = Bench(qtest=prog, compact=compact, timeout=timeout)
+    flagged, results = b.run(ops, sizes)
+    if output != "":
+        with open(output, "w") as f:
+            json.dump(results, f, indent=2)
+    if flagged:
+        print("---\tSlower than expected: %s" % ", ".join(flagged))
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
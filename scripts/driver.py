@@ -4,10 +4,23 @@ from __future__ import print_function
 import subprocess
 import sys
 import getopt
+import json
+import os
+import re
+import tempfile
+import time
+import trace2bin
 
 
 
 # Driver program for C programming exercise
+#
+# The traces run at once, one per CPU, and are reported in order.  The
+# complexity trace times the operations, so it keeps a CPU to itself, or runs
+# alone after the others on a single CPU.  Their times and the results of a
+# bench suite can be recorded as a baseline, which later runs must not be
+# slower than.  The times are noisy, so a run is only deemed slower if it is
+# again when measured once more.
 class Tracer:
 
     traceDirectory = "./traces"
@@ -17,6 +30,16 @@ class Tracer:
     autograde = False
     useValgrind = False
     colored = False
+    compact = False
+    binary = False
+    jobs = 0
+    isolate = None
+    bench = False
+    baseline = ""
+    saveBaseline = ""
+    threshold = 25
+    home = None
+    isolated = []
 
     traceDict = {
         1: "trace-01-ops",
@@ -35,7 +58,15 @@ class Tracer:
         14: "trace-14-perf",
         15: "trace-15-perf",
         16: "trace-16-perf",
-        17: "trace-17-complexity"
+        17: "trace-17-complexity",
+        18: "trace-18-snapshot",
+        19: "trace-19-bulk",
+        20: "trace-20-dedup",
+        21: "trace-21-compact",
+        22: "trace-22-radix",
+        23: "trace-23-psort",
+        24: "trace-24-threads",
+        25: "trace-25-hugepage"
     }
 
     traceProbs = {
@@ -58,7 +89,33 @@ class Tracer:
         17: "Trace-17"
     }
 
-    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
+    # Traces past trace-17 test the extensions of the queue, and score no
+    # points, but a run fails all the same if one of them does
+    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5, 0, 0, 0, 0, 0, 0, 0, 0]
+
+    # Trace measuring timing with dudect, which must not share its CPUs
+    timingTrace = 17
+
+    # Benchmarks recorded in the baseline along with the traces, and how
+    # many allocations each one makes
+    benchSuite = [
+        "bench -j -s 100000 ih 1000 8",
+        "bench -j -s 100000 it 1000 8",
+        "bench -j -s 100000 rh 1000 8",
+        "bench -j -s 100000 rt 1000 8",
+        "bench -j -r 5 reverse 100000 8",
+        "bench -j -r 5 dedup 100000 8",
+        "bench -j -r 5 sort 100000 8",
+    ]
+
+    # Times the bench suite runs, each operation keeping its best results
+    benchRepeats = 5
+
+    # CPU seconds a trace, and cycles an operation of the bench suite, may
+    # take over the baseline, however fast they are.  The timing trace runs
+    # for as long as dudect needs to decide, so its time is only recorded.
+    slack = 0.05
+    benchSlack = 256
 
     RED = '\033[91m'
     GREEN = '\033[92m'
@@ -69,39 +126,348 @@ class Tracer:
                  verbLevel=0,
                  autograde=False,
                  useValgrind=False,
-                 colored=False):
+                 colored=False,
+                 compact=False,
+                 binary=False,
+                 jobs=0,
+                 isolate=None,
+                 bench=False,
+                 baseline="",
+                 saveBaseline="",
+                 threshold=25):
         if qtest != "":
             self.qtest = qtest
         self.verbLevel = verbLevel
         self.autograde = autograde
         self.useValgrind = useValgrind
         self.colored = colored
+        self.compact = compact
+        self.binary = binary
+        self.jobs = jobs
+        self.isolate = isolate
+        self.bench = bench
+        self.baseline = baseline
+        self.saveBaseline = saveBaseline
+        self.threshold = threshold
 
     def printInColor(self, text, color):
         if self.colored == False:
             color = self.WHITE
         print(color, text, self.WHITE, sep = '')
 
-    def runTrace(self, tid):
-        if not tid in self.traceDict:
-            self.printInColor("ERROR: No trace with id %d" % tid, self.RED)
-            return False
+    # Children inherit the affinity of the driver when they are spawned
+    def pin(self, cpus):
+        if cpus and hasattr(os, "sched_setaffinity"):
+            os.sched_setaffinity(0, cpus)
+
+    # Start qtest on a trace, with its output kept aside unless it is live
+    def startTrace(self, job, cpus):
+        tid = job["tid"]
         fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
         vname = "%d" % self.verbLevel
-        clist = self.command + ["-v", vname, "-f", fname]
+        if self.binary:
+            (fd, job["bin"]) = tempfile.mkstemp(suffix=".bin")
+            os.close(fd)
+            trace2bin.convert(fname, job["bin"])
+            clist = self.command + ["-v", vname, "-b", job["bin"]]
+        else:
+            clist = self.command + ["-v", vname, "-f", fname]
+        if self.compact:
+            clist.append("-c")
 
+        actions = []
+        if job["live"]:
+            if self.verbLevel > 0:
+                print("+++ TESTING trace %s:" % self.traceDict[tid])
+            sys.stdout.flush()
+        else:
+            job["out"] = tempfile.TemporaryFile()
+            fd = job["out"].fileno()
+            actions = [(os.POSIX_SPAWN_DUP2, fd, 1),
+                       (os.POSIX_SPAWN_DUP2, fd, 2)]
+        self.pin(cpus)
+        job["start"] = time.time()
         try:
-            retcode = subprocess.call(clist)
+            job["pid"] = os.posix_spawnp(clist[0], clist, os.environ,
+                                         file_actions=actions)
+        except Exception as e:
+            job["error"] = "Call of '%s' failed: %s" % (" ".join(clist), e)
+            self.endTrace(job, None)
+        finally:
+            self.pin(self.home)
+
+    def endTrace(self, job, status, rusage=None):
+        job["done"] = True
+        job["ok"] = status is not None and os.WIFEXITED(status) and \
+            os.WEXITSTATUS(status) == 0
+        job["wall"] = time.time() - job["start"]
+        if rusage is not None:
+            job["cpu"] = rusage.ru_utime + rusage.ru_stime
+        if "bin" in job:
+            os.remove(job["bin"])
+
+    # Report the traces done so far, in the order of their ids
+    def reportTraces(self, jobs):
+        for job in jobs:
+            if not job["done"]:
+                return
+            if job["reported"]:
+                continue
+            job["reported"] = True
+            tname = self.traceDict[job["tid"]]
+            if not job["live"]:
+                if self.verbLevel > 0:
+                    print("+++ TESTING trace %s:" % tname)
+                sys.stdout.flush()
+                if "out" in job:
+                    job["out"].seek(0)
+                    out = sys.stdout.buffer if hasattr(sys.stdout, "buffer") \
+                        else sys.stdout
+                    out.write(job["out"].read())
+                    out.flush()
+                    job["out"].close()
+            if "error" in job:
+                self.printInColor(job["error"], self.RED)
+            maxval = self.maxScores[job["tid"]]
+            tval = maxval if job["ok"] else 0
+            if maxval == 0:
+                self.printInColor("---\t%s\t%s" %
+                                  (tname, "ok" if job["ok"] else "failed"),
+                                  self.GREEN if job["ok"] else self.RED)
+            elif tval < maxval:
+                self.printInColor("---\t%s\t%d/%d" % (tname, tval, maxval), self.RED)
+            else:
+                self.printInColor("---\t%s\t%d/%d" % (tname, tval, maxval), self.GREEN)
+
+    # Run the traces, as many at once as there are CPUs.  The timing trace
+    # has CPUs of its own, or runs alone once all the others are done.
+    # Quiet runs, only timing the traces again, report nothing.
+    def runTraces(self, tidList, quiet=False):
+        allCpus = None
+        if hasattr(os, "sched_getaffinity"):
+            allCpus = sorted(os.sched_getaffinity(0))
+        isolated = []
+        if allCpus and self.timingTrace in tidList:
+            if self.isolate is not None:
+                isolated = [c for c in self.isolate if c in allCpus]
+            elif len(allCpus) > 1 and len(tidList) > 1:
+                isolated = allCpus[-1:]
+        pool = allCpus
+        if isolated:
+            pool = [c for c in allCpus if c not in isolated]
+            if not pool:
+                # no CPU left for the others, so they run before it instead
+                pool = allCpus
+                isolated = []
+        self.isolated = isolated
+        self.home = pool
+        self.pin(pool)
+        njobs = self.jobs
+        if njobs <= 0:
+            njobs = len(pool) if pool else (os.cpu_count() or 1)
+
+        jobs = [{"tid": t, "live": False, "done": False, "reported": False,
+                 "ok": False} for t in tidList]
+        byTid = {job["tid"]: job for job in jobs}
+        queue = [job for job in jobs if job["tid"] != self.timingTrace]
+        timing = byTid.get(self.timingTrace)
+        running = {}
+
+        def start(job, cpus):
+            # nothing to wait for before its output, it can go straight out
+            job["live"] = not quiet and not running and \
+                all(j["reported"] for j in jobs if j["tid"] < job["tid"])
+            self.startTrace(job, cpus)
+            if not job["done"]:
+                running[job["pid"]] = job
+
+        if timing is not None and isolated:
+            start(timing, isolated)
+            timing = None
+        while True:
+            shared = [j for j in running.values()
+                      if j["tid"] != self.timingTrace]
+            while queue and len(shared) < njobs:
+                start(queue.pop(0), pool)
+                shared = [j for j in running.values()
+                          if j["tid"] != self.timingTrace]
+            if timing is not None and not queue and not running:
+                start(timing, allCpus)
+                timing = None
+            if not quiet:
+                self.reportTraces(jobs)
+            if not running:
+                break
+            (pid, status, rusage) = os.wait4(-1, 0)
+            if pid in running:
+                self.endTrace(running.pop(pid), status, rusage)
+        self.home = allCpus
+        self.pin(allCpus)
+        if quiet:
+            for job in jobs:
+                if "out" in job:
+                    job["out"].close()
+        return jobs
+
+    # Run the bench suite once, on the CPUs of the timing trace if it has any
+    def runBenchOnce(self):
+        clist = [self.qtest, "-v", "1"]
+        if self.compact:
+            clist.append("-c")
+        cmd = "option profile 1\n" + "\n".join(self.benchSuite) + "\nquit\n"
+        self.pin(self.isolated)
+        try:
+            out = subprocess.run(clist, input=cmd, stdout=subprocess.PIPE,
+                                 universal_newlines=True).stdout
         except Exception as e:
             self.printInColor("Call of '%s' failed: %s" % (" ".join(clist), e), self.RED)
+            return None
+        finally:
+            self.pin(self.home)
+        results = {}
+        last = None
+        for line in out.splitlines():
+            if line.startswith("{"):
+                r = json.loads(line)
+                last = results[r["op"]] = {k: r[k] for k in
+                                           ("p50", "p99", "throughput")}
+                continue
+            m = re.match(r"Profile bench: (\d+) mallocs, \d+ frees, (\d+) bytes",
+                         line)
+            if m and last is not None:
+                last["mallocs"] = int(m.group(1))
+                last["bytes"] = int(m.group(2))
+                last = None
+        if len(results) < len(self.benchSuite):
+            self.printInColor("ERROR: Bench suite failed", self.RED)
+            return None
+        return results
+
+    # Keep the best of the results of each operation in best
+    def mergeBench(self, best, results):
+        for (op, r) in results.items():
+            if op not in best:
+                best[op] = dict(r)
+                continue
+            b = best[op]
+            for k in ("p50", "p99", "mallocs", "bytes"):
+                if k in r:
+                    b[k] = min(b[k], r[k]) if k in b else r[k]
+            b["throughput"] = max(b["throughput"], r["throughput"])
+
+    # Run the bench suite several times, and keep the best of each operation
+    def runBench(self):
+        best = {}
+        for i in range(self.benchRepeats):
+            results = self.runBenchOnce()
+            if results is None:
+                return None
+            self.mergeBench(best, results)
+        return best
+
+    # Time the traces passing once more, keeping the best time of each
+    def retimeTraces(self, record, tnames):
+        byName = {v: k for (k, v) in self.traceDict.items()}
+        for job in self.runTraces([byName[t] for t in tnames], quiet=True):
+            t = record["traces"][self.traceDict[job["tid"]]]
+            if job["ok"]:
+                t["wall"] = min(t["wall"], round(job["wall"], 4))
+                t["cpu"] = min(t["cpu"], round(job.get("cpu", 0.0), 4))
+
+    # Whether value grew over its baseline by more than the threshold
+    def slower(self, value, base, slack=0):
+        return value > base * (1 + self.threshold / 100.0) and \
+            value - base > slack
+
+    # Whether the trace took longer than in the baseline, in CPU time, which
+    # is what the other traces running at once disturb the least
+    def traceSlower(self, tname, t, base):
+        if tname == self.traceDict[self.timingTrace] or tname not in base:
             return False
-        return retcode == 0
+        b = base[tname]
+        if "cpu" in b and b["cpu"] > 0:
+            return self.slower(t["cpu"], b["cpu"], self.slack)
+        return self.slower(t["wall"], b["wall"], self.slack)
+
+    def benchSlower(self, r, b):
+        return self.slower(r["p50"], b["p50"], self.benchSlack) or \
+            self.slower(r["mallocs"], b["mallocs"])
+
+    # The traces and the operations of the bench suite slower than the baseline
+    def findRegressions(self, record, base):
+        traces = base.get("traces", {})
+        benches = base.get("bench", {})
+        slowTraces = [tname for (tname, t) in record["traces"].items()
+                      if self.traceSlower(tname, t, traces)]
+        slowBench = [op for (op, r) in record.get("bench", {}).items()
+                     if op in benches and self.benchSlower(r, benches[op])]
+        return (slowTraces, slowBench)
+
+    def checkBaseline(self, record):
+        base = {}
+        if self.baseline != "" and os.path.exists(self.baseline):
+            with open(self.baseline) as f:
+                base = json.load(f)
+        elif self.baseline != "" and self.saveBaseline == "":
+            print("---\tNo baseline in %s, saving this run" % self.baseline)
+            self.saveBaseline = self.baseline
+
+        # measure once more what looks slower, it must be slower again
+        (slowTraces, slowBench) = self.findRegressions(record, base)
+        if slowTraces or slowBench:
+            print("---\tMeasuring again: %s" %
+                  ", ".join(slowTraces + slowBench))
+            if slowTraces:
+                self.retimeTraces(record, slowTraces)
+            if slowBench:
+                results = self.runBench()
+                if results is not None:
+                    self.mergeBench(record["bench"], results)
+            (slowTraces, slowBench) = self.findRegressions(record, base)
+
+        traces = base.get("traces", {})
+        print("---\tTrace\t\t\tCPU\tBaseline\tSeconds\tBaseline")
+        for (tname, t) in record["traces"].items():
+            if tname not in traces:
+                print("---\t%-20s\t%.3f\t\t\t%.3f" %
+                      (tname, t["cpu"], t["wall"]))
+                continue
+            b = traces[tname]
+            bad = tname in slowTraces
+            self.printInColor("---\t%-20s\t%.3f\t%.3f\t\t%.3f\t%.3f%s" %
+                              (tname, t["cpu"], b.get("cpu", 0.0), t["wall"],
+                               b["wall"], "\tSLOWER" if bad else ""),
+                              self.RED if bad else self.GREEN)
+
+        benches = base.get("bench", {})
+        if "bench" in record:
+            print("---\tBench\t\tp50\tBaseline\tmallocs\tBaseline")
+        for (op, r) in record.get("bench", {}).items():
+            if op not in benches:
+                print("---\t%-8s\t%d\t\t\t%d" % (op, r["p50"], r["mallocs"]))
+                continue
+            b = benches[op]
+            bad = op in slowBench
+            self.printInColor("---\t%-8s\t%d\t%d\t\t%d\t%d%s" %
+                              (op, r["p50"], b["p50"], r["mallocs"],
+                               b["mallocs"], "\tSLOWER" if bad else ""),
+                              self.RED if bad else self.GREEN)
+
+        regressions = slowTraces + slowBench
+        if regressions:
+            self.printInColor("---\tSlower than the baseline by more than "
+                              "%d%%: %s" % (self.threshold,
+                                            ", ".join(regressions)), self.RED)
+        if self.saveBaseline != "":
+            with open(self.saveBaseline, "w") as f:
+                json.dump(record, f, indent=2)
+        return not regressions
 
     def run(self, tid=0):
-        scoreDict = {k: 0 for k in self.traceDict.keys()}
+        scoreDict = {k: 0 for k in self.traceProbs.keys()}
         print("---\tTrace\t\tPoints")
         if tid == 0:
-            tidList = self.traceDict.keys()
+            tidList = list(self.traceDict.keys())
         else:
             if not tid in self.traceDict:
                 self.printInColor("ERROR: Invalid trace ID %d" % tid, self.RED)
@@ -113,20 +479,15 @@ class Tracer:
             self.command = ['valgrind', self.qtest]
         else:
             self.command = [self.qtest]
-        for t in tidList:
-            tname = self.traceDict[t]
-            if self.verbLevel > 0:
-                print("+++ TESTING trace %s:" % tname)
-            ok = self.runTrace(t)
+        jobs = self.runTraces(tidList)
+        for job in jobs:
+            t = job["tid"]
             maxval = self.maxScores[t]
-            tval = maxval if ok else 0
-            if tval < maxval:
-                self.printInColor("---\t%s\t%d/%d" % (tname, tval, maxval), self.RED)
-            else:
-                self.printInColor("---\t%s\t%d/%d" % (tname, tval, maxval), self.GREEN)
+            tval = maxval if job["ok"] else 0
             score += tval
             maxscore += maxval
-            scoreDict[t] = tval
+            if t in scoreDict:
+                scoreDict[t] = tval
         if score < maxscore:
             self.printInColor("---\tTOTAL\t\t%d/%d" % (score, maxscore), self.RED)
         else:
@@ -142,15 +503,46 @@ class Tracer:
                 jstring += '"%s" : %d' % (self.traceProbs[k], scoreDict[k])
             jstring += '}}'
             print(jstring)
-        if score < maxscore:
+        ok = score == maxscore and all(job["ok"] for job in jobs)
+        if self.bench or self.baseline != "" or self.saveBaseline != "":
+            # only the traces that passed ran through to the end
+            record = {"traces": {}}
+            for job in jobs:
+                if job["ok"]:
+                    record["traces"][self.traceDict[job["tid"]]] = \
+                        {"wall": round(job["wall"], 4),
+                         "cpu": round(job.get("cpu", 0.0), 4)}
+            if self.bench:
+                results = self.runBench()
+                if results is None:
+                    ok = False
+                else:
+                    record["bench"] = results
+            if not self.checkBaseline(record):
+                ok = False
+        if not ok:
             sys.exit(1)
 
 def usage(name):
-    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c]" % name)
+    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [-j JOBS] [--valgrind] [--compact] [--binary] [--isolate CPUS] [--bench] [--baseline FILE] [--save-baseline FILE] [--threshold PCT] [-c]" % name)
     print("  -h        Print this message")
     print("  -p PROG   Program to test")
     print("  -t TID    Trace ID to test")
     print("  -v VLEVEL Set verbosity level (0-3)")
+    print("  -j JOBS   Traces to run at once (default: one per CPU)")
+    print("  --compact Test the compact queue instead of the linked list")
+    print("  --binary  Replay the traces compiled by trace2bin.py")
+    print("  --isolate CPUS")
+    print("            Comma separated CPUs kept for trace-17 (default: the last")
+    print("            one; with a single CPU, trace-17 runs after the others)")
+    print("  --bench   Run the bench suite too, and record its results")
+    print("  --baseline FILE")
+    print("            Fail if slower than the run recorded in FILE, saving this")
+    print("            run there if there is none")
+    print("  --save-baseline FILE")
+    print("            Record the times of this run in FILE")
+    print("  --threshold PCT")
+    print("            Slowdown over the baseline deemed a regression (default: 25)")
     print("  -c Enable colored text")
     sys.exit(0)
 
@@ -163,8 +555,19 @@ def run(name, args):
     autograde = False
     useValgrind = False
     colored = False
+    compact = False
+    binary = False
+    jobs = 0
+    isolate = None
+    bench = False
+    baseline = ""
+    saveBaseline = ""
+    threshold = 25
 
-    optlist, args = getopt.getopt(args, 'hp:t:v:A:c', ['valgrind'])
+    optlist, args = getopt.getopt(args, 'hp:t:v:j:A:c',
+                                  ['valgrind', 'compact', 'binary', 'isolate=',
+                                   'bench', 'baseline=', 'save-baseline=',
+                                   'threshold='])
     for (opt, val) in optlist:
         if opt == '-h':
             usage(name)
@@ -175,10 +578,26 @@ def run(name, args):
         elif opt == '-v':
             vlevel = int(val)
             levelFixed = True
+        elif opt == '-j':
+            jobs = int(val)
         elif opt == '-A':
             autograde = True
         elif opt == '--valgrind':
             useValgrind = True
+        elif opt == '--compact':
+            compact = True
+        elif opt == '--binary':
+            binary = True
+        elif opt == '--isolate':
+            isolate = [int(c) for c in val.split(',') if c != '']
+        elif opt == '--bench':
+            bench = True
+        elif opt == '--baseline':
+            baseline = val
+        elif opt == '--save-baseline':
+            saveBaseline = val
+        elif opt == '--threshold':
+            threshold = int(val)
         elif opt == '-c':
             colored = True
         else:
@@ -190,7 +609,15 @@ def run(name, args):
                verbLevel=vlevel,
                autograde=autograde,
                useValgrind=useValgrind,
-               colored=colored)
+               colored=colored,
+               compact=compact,
+               binary=binary,
+               jobs=jobs,
+               isolate=isolate,
+               bench=bench,
+               baseline=baseline,
+               saveBaseline=saveBaseline,
+               threshold=threshold)
     t.run(tid)
 
 
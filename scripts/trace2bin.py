@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+
+from __future__ import print_function
+import struct
+import sys
+
+# Compile a trace of qtest commands into the binary trace replayed by
+# 'qtest -b'.
+#
+# All the fields are 32-bit little-endian words:
+#
+#   "QTB1", size of the string table, number of records
+#   string table: NUL-terminated strings, padded to a multiple of 4 bytes
+#   records: repeat count, argc, then argc offsets into the string table
+#
+# Every word of the trace is stored once in the string table, and runs of
+# identical lines become a single record repeated.
+
+MAGIC = b"QTB1"
+
+
+def compile_trace(lines):
+    table = bytearray()
+    offsets = {}
+    records = []
+
+    def intern(word):
+        if word not in offsets:
+            offsets[word] = len(table)
+            table.extend(word + b"\0")
+        return offsets[word]
+
+    for line in lines:
+        # split on the same whitespace as the console does
+        words = line.split()
+        if not words:
+            continue
+        args = [intern(w) for w in words]
+        if records and records[-1][1] == args:
+            records[-1][0] += 1
+        else:
+            records.append([1, args])
+
+    table.extend(b"\0" * (-len(table) % 4))
+    out = bytearray(MAGIC)
+    out += struct.pack("<II", len(table), len(records))
+    out += table
+    for (repeat, args) in records:
+        out += struct.pack("<II%dI" % len(args), repeat, len(args), *args)
+    return bytes(out)
+
+
+def convert(src, dst):
+    with open(src, "rb") as f:
+        data = compile_trace(f.read().split(b"\n"))
+    with open(dst, "wb") as f:
+        f.write(data)
+
+
+def usage(name):
+    print("Usage: %s IFILE OFILE" % name)
+    print("  Compile the commands of IFILE into the binary trace OFILE")
+    sys.exit(0)
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        usage(sys.argv[0])
+    convert(sys.argv[1], sys.argv[2])
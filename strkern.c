@@ -0,0 +1,306 @@
+/**
+ * Backends of the string kernels.
+ *
+ * The length and copy kernels read whole words or vectors, which may go past
+ * the terminator but never into the next page.  Sanitizers are told to leave
+ * them alone, since that is outside the allocation.  The comparisons read no
+ * byte past the buffers they are given.
+ */
+
+#include "strkern.h"
+#include <stdint.h>
+#include <string.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
+#if defined(__clang__) || defined(__GNUC__)
+#define NO_SANITIZE __attribute__((no_sanitize_address))
+#else
+#define NO_SANITIZE
+#endif
+
+/* Word the scalar kernels read at once, aliasing the bytes of strings */
+typedef uint64_t __attribute__((may_alias)) word_t;
+
+#define ONES ((uint64_t) 0x0101010101010101ULL)
+#define HIGHS ((uint64_t) 0x8080808080808080ULL)
+
+/* Whether n bytes from p run into the next page */
+#define CROSSES_PAGE(p, n) (((uintptr_t) (p) & 4095) > 4096 - (n))
+
+/* Whether some byte of w is zero */
+#define HAS_ZERO(w) (((w) - ONES) & ~(w) & HIGHS)
+
+static size_t len_libc(const char *s)
+{
+    return strlen(s);
+}
+
+static size_t copy_libc(char *dst, const char *src, size_t size)
+{
+    size_t len = strlen(src);
+    size_t n = len < size - 1 ? len : size - 1;
+
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+    return len;
+}
+
+static size_t mismatch_libc(const char *a, const char *b, size_t n)
+{
+    size_t i = 0;
+
+    if (!memcmp(a, b, n))
+        return n;
+    while (a[i] == b[i])
+        i++;
+    return i;
+}
+
+NO_SANITIZE static size_t len_scalar(const char *s)
+{
+    const char *p = s;
+
+    while ((uintptr_t) p & (sizeof(word_t) - 1)) {
+        if (!*p)
+            return p - s;
+        p++;
+    }
+    while (!HAS_ZERO(*(const word_t *) p))
+        p += sizeof(word_t);
+    while (*p)
+        p++;
+    return p - s;
+}
+
+static size_t copy_scalar(char *dst, const char *src, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size - 1 && src[i]; i++)
+        dst[i] = src[i];
+    dst[i] = '\0';
+    return src[i] ? i + len_scalar(src + i) : i;
+}
+
+static size_t mismatch_scalar(const char *a, const char *b, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + sizeof(word_t) <= n; i += sizeof(word_t)) {
+        uint64_t wa, wb;
+        memcpy(&wa, a + i, sizeof(wa));
+        memcpy(&wb, b + i, sizeof(wb));
+        if (wa != wb)
+            break;
+    }
+    while (i < n && a[i] == b[i])
+        i++;
+    return i;
+}
+
+/*
+ * Kernels of a vector backend, out of its primitives on vectors of vec bytes
+ * reporting bits bits per byte, of which the scans need the first two:
+ *   zeros_isa(p): mask of the zero bytes of the vector at p
+ *   diffs_isa(a, b): mask of the bytes the vectors at a and b differ by
+ *   move_isa(dst, src): copy the vector at src to dst
+ */
+#define VECTOR_SCANS(isa, vec, bits, target)                                 \
+    target NO_SANITIZE static size_t len_##isa(const char *s)                \
+    {                                                                        \
+        const char *p =                                                      \
+            (const char *) ((uintptr_t) s & ~(uintptr_t) ((vec) - 1));       \
+        uint64_t z = zeros_##isa(p) >> ((bits) * (s - p));                   \
+                                                                             \
+        if (z)                                                               \
+            return __builtin_ctzll(z) / (bits);                              \
+        for (;;) {                                                           \
+            p += (vec);                                                      \
+            z = zeros_##isa(p);                                              \
+            if (z)                                                           \
+                return p - s + __builtin_ctzll(z) / (bits);                  \
+        }                                                                    \
+    }                                                                        \
+                                                                             \
+    target static size_t mismatch_##isa(const char *a, const char *b,        \
+                                        size_t n)                            \
+    {                                                                        \
+        size_t i = 0;                                                        \
+                                                                             \
+        for (; i + (vec) <= n; i += (vec)) {                                 \
+            uint64_t d = diffs_##isa(a + i, b + i);                          \
+            if (d)                                                           \
+                return i + __builtin_ctzll(d) / (bits);                      \
+        }                                                                    \
+        return i + mismatch_scalar(a + i, b + i, n - i);                     \
+    }
+
+#define VECTOR_COPY(isa, vec, bits, target)                                  \
+    target NO_SANITIZE static size_t copy_##isa(char *dst, const char *src,  \
+                                                size_t size)                 \
+    {                                                                        \
+        size_t i = 0, len, n;                                                \
+                                                                             \
+        /* a vector at a time while it fits in dst and the page of src */    \
+        while (i + (vec) <= size && !CROSSES_PAGE(src + i, (vec))) {         \
+            uint64_t z = zeros_##isa(src + i);                               \
+            move_##isa(dst + i, src + i);                                    \
+            if (z) {                                                         \
+                i += __builtin_ctzll(z) / (bits);                            \
+                dst[i] = '\0';                                               \
+                return i;                                                    \
+            }                                                                \
+            i += (vec);                                                      \
+        }                                                                    \
+                                                                             \
+        /* the rest is shorter than a vector, or about to cross the page */  \
+        len = i + len_##isa(src + i);                                        \
+        n = len < size - 1 ? len : size - 1;                                 \
+        if (n > i)                                                           \
+            memcpy(dst + i, src + i, n - i);                                 \
+        dst[n] = '\0';                                                       \
+        return len;                                                          \
+    }
+
+#ifdef HAVE_X86_KERNELS
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+TARGET_SSE2 NO_SANITIZE static inline uint64_t zeros_sse2(const char *p)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    return (unsigned int) _mm_movemask_epi8(
+        _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+}
+
+TARGET_SSE2 static inline uint64_t diffs_sse2(const char *a, const char *b)
+{
+    __m128i va = _mm_loadu_si128((const __m128i *) a);
+    __m128i vb = _mm_loadu_si128((const __m128i *) b);
+    return ~(unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) &
+           0xffff;
+}
+
+TARGET_SSE2 NO_SANITIZE static inline void move_sse2(char *dst,
+                                                     const char *src)
+{
+    _mm_storeu_si128((__m128i *) dst, _mm_loadu_si128((const __m128i *) src));
+}
+
+TARGET_AVX2 NO_SANITIZE static inline uint64_t zeros_avx2(const char *p)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *) p);
+    return (uint32_t) _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+}
+
+TARGET_AVX2 static inline uint64_t diffs_avx2(const char *a, const char *b)
+{
+    __m256i va = _mm256_loadu_si256((const __m256i *) a);
+    __m256i vb = _mm256_loadu_si256((const __m256i *) b);
+    return ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+}
+
+VECTOR_SCANS(sse2, 16, 1, TARGET_SSE2)
+VECTOR_COPY(sse2, 16, 1, TARGET_SSE2)
+VECTOR_SCANS(avx2, 32, 1, TARGET_AVX2)
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+/* Narrow a mask of whole bytes to four bits per byte */
+static inline uint64_t nibbles(uint8x16_t m)
+{
+    uint8x8_t n = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(n), 0);
+}
+
+NO_SANITIZE static inline uint64_t zeros_neon(const char *p)
+{
+    return nibbles(vceqzq_u8(vld1q_u8((const uint8_t *) p)));
+}
+
+static inline uint64_t diffs_neon(const char *a, const char *b)
+{
+    uint8x16_t va = vld1q_u8((const uint8_t *) a);
+    uint8x16_t vb = vld1q_u8((const uint8_t *) b);
+    return nibbles(vmvnq_u8(vceqq_u8(va, vb)));
+}
+
+NO_SANITIZE static inline void move_neon(char *dst, const char *src)
+{
+    vst1q_u8((uint8_t *) dst, vld1q_u8((const uint8_t *) src));
+}
+
+VECTOR_SCANS(neon, 16, 4, )
+VECTOR_COPY(neon, 16, 4, )
+#endif
+
+int strkern = STRKERN_LIBC;
+
+strkern_ops_t strkern_ops = {len_libc, copy_libc, mismatch_libc};
+
+static bool supported(int backend)
+{
+    switch (backend) {
+    case STRKERN_LIBC:
+    case STRKERN_SCALAR:
+        return true;
+#ifdef HAVE_X86_KERNELS
+    case STRKERN_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case STRKERN_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+#ifdef HAVE_NEON_KERNELS
+    case STRKERN_NEON:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+/*
+ * AVX2 is only used when asked for.  Strings of a queue are too short for it
+ * to gain anything over SSE2, and waking the upper halves of the vector units
+ * up skews the timing of what runs next, the measurements of dudect included.
+ */
+int strkern_best(void)
+{
+    static const int order[] = {STRKERN_NEON, STRKERN_SSE2};
+
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+        if (supported(order[i]))
+            return order[i];
+    }
+    return STRKERN_SCALAR;
+}
+
+bool strkern_select(int backend)
+{
+    static const strkern_ops_t ops[] = {
+        [STRKERN_LIBC] = {len_libc, copy_libc, mismatch_libc},
+        [STRKERN_SCALAR] = {len_scalar, copy_scalar, mismatch_scalar},
+#ifdef HAVE_X86_KERNELS
+        [STRKERN_SSE2] = {len_sse2, copy_sse2, mismatch_sse2},
+        /* the inline strings of pooled elements are shorter than a vector */
+        [STRKERN_AVX2] = {len_avx2, copy_sse2, mismatch_avx2},
+#endif
+#ifdef HAVE_NEON_KERNELS
+        [STRKERN_NEON] = {len_neon, copy_neon, mismatch_neon},
+#endif
+    };
+
+    if (!supported(backend))
+        return false;
+
+    strkern = backend;
+    strkern_ops = ops[backend];
+    return true;
+}
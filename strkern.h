@@ -0,0 +1,100 @@
+#ifndef LAB0_STRKERN_H
+#define LAB0_STRKERN_H
+
+/* String kernels of the queue hot paths.
+ *
+ * The strings of a queue are short, so the kernels go through them a vector
+ * at a time with SSE2, AVX2 or NEON, whichever the CPU has, or a word at a
+ * time without any of them.  Elements keep the length of their string, and
+ * compare with sk_cmp() and sk_equal() without looking for terminators.
+ *
+ * The backend is picked at run time by strkern_select(), and the libc one is
+ * there to compare against.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Backends of the kernels */
+enum {
+    STRKERN_LIBC,   /* strlen(), memcpy() and memcmp() */
+    STRKERN_SCALAR, /* a word at a time */
+    STRKERN_SSE2,
+    STRKERN_AVX2,
+    STRKERN_NEON,
+};
+
+/* Backend in use, set by strkern_select() */
+extern int strkern;
+
+/**
+ * strkern_ops_t - Kernels of a backend
+ * @len: length of a string, like strlen()
+ * @copy: copy to a buffer of the given size, see sk_copy()
+ * @mismatch: index of the first byte two buffers of the given size differ
+ *            by, the size if they do not
+ */
+typedef struct {
+    size_t (*len)(const char *s);
+    size_t (*copy)(char *dst, const char *src, size_t size);
+    size_t (*mismatch)(const char *a, const char *b, size_t n);
+} strkern_ops_t;
+
+extern strkern_ops_t strkern_ops;
+
+/**
+ * strkern_best() - Get the fastest backend the CPU supports
+ */
+int strkern_best(void);
+
+/**
+ * strkern_select() - Switch to a backend
+ * @backend: one of STRKERN_*
+ *
+ * Return: false, and the backend is left as it was, if the build or the CPU
+ * does not support it
+ */
+bool strkern_select(int backend);
+
+/* Length of the string s */
+static inline size_t sk_len(const char *s)
+{
+    return strkern_ops.len(s);
+}
+
+/**
+ * sk_copy() - Copy a string and find its length in the same pass
+ * @dst: buffer of @size bytes, @size at least 1
+ * @src: string to copy
+ *
+ * At most @size - 1 bytes are copied and @dst is always terminated, like
+ * strlcpy() does.  The bytes of @dst after the terminator may be written.
+ *
+ * Return: length of @src, @size or more if it was cut
+ */
+static inline size_t sk_copy(char *dst, const char *src, size_t size)
+{
+    return strkern_ops.copy(dst, src, size);
+}
+
+/* Compare strings a and b of lengths alen and blen, ordering like strcmp() */
+static inline int sk_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+    size_t n = alen < blen ? alen : blen;
+    size_t i = strkern_ops.mismatch(a, b, n);
+
+    if (i < n)
+        return (unsigned char) a[i] - (unsigned char) b[i];
+    return (alen > blen) - (alen < blen);
+}
+
+/* Tell whether strings a and b of lengths alen and blen are equal */
+static inline bool sk_equal(const char *a,
+                            size_t alen,
+                            const char *b,
+                            size_t blen)
+{
+    return alen == blen && strkern_ops.mismatch(a, b, alen) == alen;
+}
+
+#endif /* LAB0_STRKERN_H */
@@ -1,4 +1,6 @@
 # Test if time complexity of q_insert_tail, q_insert_head, q_remove_tail, and q_remove_head is constant
+option prebuilt 1
+option crop 1
 option simulation 1
 it
 ih
@@ -0,0 +1,56 @@
+# Test of save and load
+option fail 0
+option malloc 0
+new
+ih bear
+ih dolphin
+it meerkat
+it gerbil
+save .trace-18.qts
+free
+new
+load .trace-18.qts
+rh dolphin
+rh bear
+rh meerkat
+rh gerbil
+# Loading inserts at tail of the strings already queued
+it wolf
+load .trace-18.qts
+rh wolf
+rh dolphin
+rt gerbil
+# A big snapshot is loaded in several batches
+new -p
+it aardvark 10000
+ih squirrel
+it vulture
+save .trace-18.qts
+free
+new
+load .trace-18.qts
+rh squirrel
+rt vulture
+rhq 10000
+# Malformed snapshots are rejected, and leave the queue as it was
+it jaguar
+fail load traces/trace-18-snapshot.cmd
+fail load traces/snapshot-truncated.qts
+fail load /nonexistent/lab0-trace-18.qts
+rh jaguar
+# Snapshots of compact queues load into lists, and back
+new -c
+it panda
+it zebra
+save .trace-18.qts
+new
+load .trace-18.qts
+rh panda
+save .trace-18.qts
+new -c
+load -r .trace-18.qts
+rh zebra
+fail load .trace-18.qts
+free
+fail save .trace-18.qts
+fail load .trace-18.qts
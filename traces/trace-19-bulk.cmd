@@ -0,0 +1,48 @@
+# Test of the bulk insertions and removals
+option fail 0
+option malloc 0
+option bulk 1
+new
+ih dolphin 3
+ih bear 5000
+it gerbil 5000
+it meerkat
+# Check the chains spliced on, and the nodes next to them, after every command
+option verbose 3
+ih squirrel 100
+it vulture 100
+rh squirrel
+rhq 99
+option verbose 1
+show
+rh bear
+rhq 4999
+rh dolphin
+rh dolphin
+rh dolphin
+rt vulture
+rhq 5000
+rh meerkat
+rhq 98
+rh vulture
+# Removals past the tail hand out what there is
+it wolf 10
+option fail 20
+rhq 20
+option fail 0
+it zebra
+rh zebra
+# Insertions failing in the middle of a batch leave the queue as it was,
+# strings too long for the elements of the pool are allocated apart
+option fail 30
+new -p
+ih gerbil 10
+option malloc 1
+it jaguar_meerkat_panda_wolf 20000
+ih jaguar_meerkat_panda_wolf 20000
+option malloc 0
+it wolf
+rhq 9
+rh gerbil
+rh wolf
+free
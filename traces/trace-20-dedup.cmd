@@ -0,0 +1,50 @@
+# Test of deleting duplicates from unsorted queues
+option fail 0
+option malloc 0
+new
+dedup -u
+ih gerbil
+dedup -u
+rh gerbil
+it bear
+it dolphin
+it bear
+it gerbil
+it meerkat
+it dolphin
+it bear
+it wolf
+dedup -u
+rh gerbil
+rh meerkat
+rh wolf
+# Strings sharing a long prefix are still different
+it aardvark_bear_dolphin_gerbil
+it aardvark_bear_dolphin_gerbix
+it aardvark_bear_dolphin_gerbil_
+it aardvark_bear_dolphin_gerbil
+dedup -u
+rh aardvark_bear_dolphin_gerbix
+rh aardvark_bear_dolphin_gerbil_
+# Duplicates far apart in a queue of mostly distinct strings
+new -p
+it squirrel
+ih RAND 10000
+it vulture 3
+it RAND 10000
+it squirrel
+dedup -u
+free
+# Failing to allocate the table leaves the queue as it was
+new
+it jaguar
+it panda
+it jaguar
+option malloc 100
+fail dedup -u
+option malloc 0
+rh jaguar
+rh panda
+rh jaguar
+free
+fail dedup -u
@@ -0,0 +1,89 @@
+# Test of the compact queue
+option fail 0
+option malloc 0
+new -c
+ih gerbil
+ih bear
+ih dolphin
+it meerkat
+it wolf
+size
+rh dolphin
+rt wolf
+reverse
+rh meerkat
+rh gerbil
+rh bear
+size
+# Truncated strings
+it aardvark_bear_dolphin_gerbil_jaguar
+option length 8
+rh aardvark
+option length 1024
+# Blocks allocated and freed at both ends, and the arena grown
+ih jaguar 3000
+it panda 3000
+ih squirrel
+it vulture
+size
+rh squirrel
+rt vulture
+rhq 2999
+rh jaguar
+rhq 2999
+rh panda
+# Operations on the whole queue
+it gerbil
+it bear
+it dolphin
+it bear
+it meerkat
+it zebra
+dm
+rh gerbil
+rh bear
+rh dolphin
+rh meerkat
+rh zebra
+it a
+it b
+it c
+it d
+it e
+swap
+rh b
+rh a
+rh d
+rh c
+rh e
+it wolf
+it bear
+it wolf
+it gerbil
+dedup -u
+rh bear
+rh gerbil
+it dolphin
+it gerbil
+it dolphin
+it bear
+it gerbil
+shuffle 1
+sort
+dedup
+rh bear
+it RAND 5000
+shuffle
+sort
+# Growing the arena fails, and leaves the strings queued in place
+new -c
+it lion
+option fail 1000
+option malloc 50
+it tiger_leopard_panther_jaguar 1000
+option malloc 0
+option fail 0
+it wolf
+rt wolf
+rh lion
+free
@@ -0,0 +1,58 @@
+# Test of the radix sort
+option fail 0
+option malloc 0
+option sortalgo 1
+new -p
+it RAND 20000
+sort
+it RAND 5000
+ih RAND 5000
+sort
+free
+# Strings sharing prefixes longer than the radix goes deep, and duplicates
+new -p
+it aardvark_bear_dolphin_gerbil_jaguar_meerkat_wolf 30
+it aardvark_bear_dolphin_gerbil_jaguar_meerkat_panda 30
+it aardvark_bear_dolphin_gerbil_jaguar_meerkat 30
+it aardvark_bear_dolphin_gerbil_jaguar_meerkat_wolf 30
+it aardvark 20
+it aardvark_bear_dolphin_gerbil_jaguar_meerkat_panda 30
+it zebra 20
+ih squirrel 20
+ih aardvark_bear 20
+sort
+rhq 20
+rh aardvark_bear
+rhq 19
+rhq 30
+rh aardvark_bear_dolphin_gerbil_jaguar_meerkat_panda
+rhq 59
+rh aardvark_bear_dolphin_gerbil_jaguar_meerkat_wolf
+rhq 59
+rh squirrel
+rhq 19
+rh zebra
+rhq 19
+size
+# Buckets small enough for the insertion sort, of strings of all lengths
+it gerbil
+it bear
+it gerbilbear
+it dolphin
+it gerb
+it bearbear
+it gerbil
+it be
+sort
+rh be
+rh bear
+rh bearbear
+rh dolphin
+rh gerb
+rh gerbil
+rh gerbil
+rh gerbilbear
+it RAND 1000
+ih RAND 1000
+sort
+free
@@ -0,0 +1,34 @@
+# Test of the merge sort spread over several threads
+option fail 0
+option malloc 0
+option threads 4
+new
+it RAND 20000
+ih RAND 20000
+sort
+it gerbil 5000
+ih bear 5000
+it RAND 10000
+sort
+free
+new -p
+it RAND 30000
+it dolphin 3000
+sort
+reverse
+sort
+free
+# Odd numbers of runs, and more threads than runs
+new -p
+option threads 3
+it RAND 13000
+sort
+option threads 64
+it RAND 20000
+sort
+# Too few elements for a thread of their own
+option threads 4
+new
+it RAND 8000
+sort
+free
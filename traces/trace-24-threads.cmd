@@ -0,0 +1,17 @@
+# Test of the queues shared by threads
+option fail 0
+option malloc 0
+mt 2 2 2000
+mt -l 2 2 2000
+mt 4 1 2000
+mt 1 4 2000
+ws 2 12
+ws -l 2 12
+ws 4 10
+ws 1 8
+# Blocks counted without allocated_lock
+option harness 0
+mt 2 2 2000
+mt -l 2 2 2000
+ws 2 12
+option harness 1
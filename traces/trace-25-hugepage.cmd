@@ -0,0 +1,18 @@
+# Test of the slabs of pooled queues mapped on huge pages
+option fail 0
+option malloc 0
+option hugepage 1
+new -p
+it RAND 100000
+sort
+rhq 50000
+it RAND 50000
+free
+# Taken from the hugetlbfs pool first, falling back to plain pages
+option hugepage 2
+new -p
+ih RAND 100000
+reverse
+rhq 100000
+free
+option hugepage 0
@@ -0,0 +1,157 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "harness.h"
+#include "wsdeque.h"
+
+/* Elements of the smallest array, a power of two */
+#define WS_MIN_SIZE 64
+
+/* Keep the positions of the owner and of the thieves on cache lines of their
+ * own
+ */
+#define CACHE_LINE 64
+
+typedef struct ws_array {
+    int64_t mask;          /* size - 1 */
+    struct ws_array *prev; /* array replaced by this one, or NULL */
+    _Atomic(element_t *) slots[];
+} ws_array_t;
+
+/*
+ * The elements sit at positions top to bottom - 1, at index position & mask
+ * of the array.  The owner works at bottom, the head, and thieves at top, the
+ * tail.
+ */
+struct wsdeque {
+    atomic_llong top;
+    char pad0[CACHE_LINE - sizeof(atomic_llong)];
+    atomic_llong bottom;
+    _Atomic(ws_array_t *) array;
+};
+
+static ws_array_t *array_new(int64_t size, ws_array_t *prev)
+{
+    ws_array_t *a = malloc(sizeof(ws_array_t) + size * sizeof(a->slots[0]));
+    if (!a)
+        return NULL;
+    a->mask = size - 1;
+    a->prev = prev;
+    return a;
+}
+
+wsdeque_t *ws_new()
+{
+    wsdeque_t *q = malloc(sizeof(wsdeque_t));
+    if (!q)
+        return NULL;
+
+    ws_array_t *a = array_new(WS_MIN_SIZE, NULL);
+    if (!a) {
+        free(q);
+        return NULL;
+    }
+    atomic_init(&q->top, 0);
+    atomic_init(&q->bottom, 0);
+    atomic_init(&q->array, a);
+    return q;
+}
+
+void ws_free(wsdeque_t *q)
+{
+    element_t *e;
+
+    if (!q)
+        return;
+    while ((e = ws_pop(q)))
+        q_release_element(e);
+
+    ws_array_t *a = atomic_load(&q->array);
+    while (a) {
+        ws_array_t *prev = a->prev;
+        free(a);
+        a = prev;
+    }
+    free(q);
+}
+
+/* Double the array holding positions top to bottom - 1 */
+static ws_array_t *grow(wsdeque_t *q, ws_array_t *a, int64_t top,
+                        int64_t bottom)
+{
+    ws_array_t *n = array_new(2 * (a->mask + 1), a);
+    if (!n)
+        return NULL;
+
+    for (int64_t i = top; i < bottom; i++)
+        atomic_store_explicit(
+            &n->slots[i & n->mask],
+            atomic_load_explicit(&a->slots[i & a->mask], memory_order_relaxed),
+            memory_order_relaxed);
+    atomic_store_explicit(&q->array, n, memory_order_release);
+    return n;
+}
+
+bool ws_push(wsdeque_t *q, element_t *e)
+{
+    int64_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+    ws_array_t *a = atomic_load_explicit(&q->array, memory_order_relaxed);
+
+    if (b - t > a->mask) {
+        a = grow(q, a, t, b);
+        if (!a)
+            return false;
+    }
+    atomic_store_explicit(&a->slots[b & a->mask], e, memory_order_relaxed);
+    /* thieves seeing the new bottom see the element too */
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+    return true;
+}
+
+element_t *ws_pop(wsdeque_t *q)
+{
+    int64_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+    ws_array_t *a = atomic_load_explicit(&q->array, memory_order_relaxed);
+    element_t *e = NULL;
+
+    /* claim the head before looking at how far the thieves got */
+    atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&q->top, memory_order_relaxed);
+
+    if (t <= b) {
+        e = atomic_load_explicit(&a->slots[b & a->mask], memory_order_relaxed);
+        if (t == b) {
+            /* the last element, race the thieves for it */
+            if (!atomic_compare_exchange_strong_explicit(
+                    &q->top, &t, t + 1, memory_order_seq_cst,
+                    memory_order_relaxed))
+                e = NULL;
+            atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+    }
+    return e;
+}
+
+element_t *ws_steal(wsdeque_t *q)
+{
+    int64_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+
+    if (t >= b)
+        return NULL;
+
+    ws_array_t *a = atomic_load_explicit(&q->array, memory_order_acquire);
+    element_t *e =
+        atomic_load_explicit(&a->slots[t & a->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(
+            &q->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return e;
+}
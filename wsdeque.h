@@ -0,0 +1,66 @@
+#ifndef LAB0_WSDEQUE_H
+#define LAB0_WSDEQUE_H
+
+/* Work-stealing deque of queue elements, after Chase and Lev.
+ *
+ * Every deque has one owner thread, which inserts and removes at the head
+ * like q_insert_head() and q_remove_head(), last in first out.  Any other
+ * thread may steal from the tail like q_remove_tail(), taking the oldest
+ * element.  The owner only synchronizes with thieves when the deque is about
+ * to run empty.
+ *
+ * The elements live in a circular array, which the owner doubles when it is
+ * full.  Thieves may still be reading the array replaced, so it is only freed
+ * with the deque.
+ */
+
+#include <stdbool.h>
+
+#include "queue.h"
+
+typedef struct wsdeque wsdeque_t;
+
+/**
+ * ws_new() - Create an empty work-stealing deque
+ *
+ * Return: NULL for allocation failed
+ */
+wsdeque_t *ws_new();
+
+/**
+ * ws_free() - Free the deque and the elements still in it, no effect if deque
+ *             is NULL
+ * @q: the deque, no other thread may use it anymore
+ */
+void ws_free(wsdeque_t *q);
+
+/**
+ * ws_push() - Insert an element at the head of the deque, by its owner
+ * @q: the deque
+ * @e: the element, as made by mpmc_new_element(), handed over to the deque on
+ *     success
+ *
+ * Return: true for success, false for allocation failed growing the deque
+ */
+bool ws_push(wsdeque_t *q, element_t *e);
+
+/**
+ * ws_pop() - Remove the element at the head of the deque, by its owner
+ * @q: the deque
+ *
+ * Return: the element, NULL if the deque is empty
+ */
+element_t *ws_pop(wsdeque_t *q);
+
+/**
+ * ws_steal() - Remove the element at the tail of the deque, by any thread
+ * @q: the deque
+ *
+ * Lock-free.
+ *
+ * Return: the element, NULL if the deque is empty or another thread took the
+ * element first
+ */
+element_t *ws_steal(wsdeque_t *q);
+
+#endif /* LAB0_WSDEQUE_H */